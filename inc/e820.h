@@ -0,0 +1,37 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The BIOS physical memory map. boot/boot.S collects it with INT 0x15,
+// AX=0xE820 while still in real mode, and leaves it for the kernel at
+// physical address E820_MAP, where i386_detect_memory picks it up.
+// Both sides include this file, so keep it assembler-friendly.
+
+#define E820_MAP	0x8000		// Physical address of struct E820Map
+#define E820_NMAX	32		// Most entries boot.S will collect
+#define E820_SMAP	0x534d4150	// 'SMAP', the call's magic signature
+
+// Values of ee_type
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// In use by the BIOS or a device
+#define E820_ACPI	3		// ACPI tables, reclaimable
+#define E820_NVS	4		// ACPI non-volatile storage
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+// One entry, exactly as the BIOS writes it
+struct E820Entry {
+	uint64_t ee_addr;		// Start of the range
+	uint64_t ee_len;		// Length of the range, in bytes
+	uint32_t ee_type;		// E820_RAM etc.
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t em_nentries;		// Zero if the BIOS doesn't do E820
+	struct E820Entry em_entries[E820_NMAX];
+};
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
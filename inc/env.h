@@ -9,25 +9,41 @@
 
 typedef int32_t envid_t;
 
-// An environment ID 'envid_t' has three parts:
+// An environment ID 'envid_t' has four parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+--3--+--------------16--------------+--------12--------+
+// |0| Env |          Uniqueifier         |   Environment    |
+// | | Hi  |                              |    Index Lo      |
+// +-------+------------------------------+------------------+
 //
-// The environment index ENVX(eid) equals the environment's offset in the
-// 'envs[]' array.  The uniqueifier distinguishes environments that were
-// created at different times, but share the same environment index.
+// The environment index ENVX(eid), the Hi and Lo parts put back together,
+// equals the environment's offset in the 'envs[]' array.  The uniqueifier
+// distinguishes environments that were created at different times, but
+// share the same environment index.  The index is split so that the
+// first 4096 environments get the same IDs they did when there were only
+// 1024 of them: 0x1000 for the first, and so on.
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
+//
+// envs[] grows a page at a time as environments are created, so only the
+// part of it at UENVS that's been used so far is mapped. NENV of them
+// fill the whole UENVS window.
 
-#define LOG2NENV		10
-#define NENV			(1 << LOG2NENV)  // 2^LOG2NENV, or 2^10, 1024.
-#define ENVX(envid)		((envid) & (NENV - 1))
+#define LOG2NENV		15
+#define NENV			(1 << LOG2NENV)  // 2^LOG2NENV, or 2^15, 32768.
+#define ENVXLOBITS		12
+#define ENVGENSHIFT		ENVXLOBITS
+#define ENVGENBITS		16
+#define ENVXHISHIFT		(ENVGENSHIFT + ENVGENBITS)
+#define ENVX(envid)		(((envid) & ((1 << ENVXLOBITS) - 1)) | \
+				 (((envid) >> (ENVXHISHIFT - ENVXLOBITS)) & \
+				  (NENV - (1 << ENVXLOBITS))))
+#define ENVGEN(envid)		(((envid) >> ENVGENSHIFT) & ((1 << ENVGENBITS) - 1))
+#define ENVID(gen, envx)	(((envx) & ((1 << ENVXLOBITS) - 1)) | \
+				 ((gen) << ENVGENSHIFT) | \
+				 (((envx) >> ENVXLOBITS) << ENVXHISHIFT))
 
 // Values of env_status in struct Env
 enum {
@@ -35,7 +51,8 @@ enum {
 	ENV_DYING,
 	ENV_RUNNABLE,
 	ENV_RUNNING,
-	ENV_NOT_RUNNABLE
+	ENV_NOT_RUNNABLE,
+	ENV_REAPING		// Freed, but its memory isn't all back yet
 };
 
 // Special environment types
@@ -43,6 +60,14 @@ enum EnvType {
 	ENV_TYPE_USER = 0,
 };
 
+// Flags for sys_vm_reserve
+#define VM_GROWSDOWN		0x1	// A stack, that grows down as it's used
+#define VM_AROUND_SHIFT		8
+#define VM_AROUND(n)		((n) << VM_AROUND_SHIFT)  // Map n pages a fault
+#define VM_AROUND_PAGES(flags)	((unsigned) (flags) >> VM_AROUND_SHIFT)
+
+struct EnvVm;
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		  // Next free Env
@@ -55,6 +80,7 @@ struct Env {
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct EnvVm *env_vm;		// Binary and regions to page in (kernel only)
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
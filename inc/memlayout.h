@@ -77,7 +77,9 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     +------------------------------+                   |
+ *                     |  Per-CPU kmap windows (*)    | RW/--             |
+ * MMIOLIM, KMAPBASE > +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
@@ -134,6 +136,11 @@
 
 // Memory-mapped IO.
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
+
+// Windows for temporarily mapping physical pages that are beyond the
+// KERNBASE map, one small window per CPU. They live at the bottom of the
+// kernel stack area, far below the lowest CPU's stack.
+#define KMAPBASE	MMIOLIM
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
 #define ULIM		(MMIOBASE)
@@ -228,6 +235,19 @@ struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;  // 4 bytes
 
+	union {
+		// Points at whatever points at us on a free list (the list
+		// head or the previous page's pp_link), so the buddy
+		// allocator can unlink a free block in O(1) when it merges
+		// it with its buddy.
+		struct PageInfo **pp_pprev;  // 4 bytes
+
+		// For a page table in use, how many of its entries are
+		// present, so that it can be freed once there are none
+		// (see page_remove).
+		uint32_t pp_nptes;  // 4 bytes
+	};
+
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
 	// Pages allocated at boot time using pmap.c's
@@ -235,10 +255,21 @@ struct PageInfo {
 
 	uint16_t pp_ref;  // 2 bytes
 
-	// Plus 2 bytes of implied padding to hit stride address and ensure
-	// that two instances of PageInfo can be next to each other and
-	// both be self-aligned on 4-byte boundaries (as dictated by the
-	// largest  scalar member of PageInfo, pp_link, which is 4 bytes).
+	// log2 of the number of pages in the block this page heads, for
+	// both free blocks and blocks handed out by page_alloc_order.
+	// Only meaningful on the first page of a block.
+	uint8_t pp_order;  // 1 byte
+
+	// PP_* flags, see kern/pmap.h
+	uint8_t pp_flags;  // 1 byte
+
+	// The page table entries mapping this page: a single one, or a
+	// tagged pointer to a chain of them. See kern/rmap.c.
+	uintptr_t pp_rmap;  // 4 bytes
+
+	// 16 bytes in total, so instances of PageInfo can sit next to
+	// each other and all be self-aligned on 4-byte boundaries (as
+	// dictated by the largest scalar members, the pointers).
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -86,6 +86,11 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries (see lib/fork.c).
+// It is one of the PTE_AVAIL bits, but the kernel makes copy-on-write
+// mappings of its own too, when it merges identical pages (kern/ksm.c).
+#define PTE_COW		0x800
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -93,6 +98,10 @@
 // bits.
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address in a page directory entry that maps a 4MB superpage (PTE_PS).
+// Masks in the 10 highest bits.
+#define PDE_PS_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -107,6 +116,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -23,6 +23,8 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	uint32_t cpu_cr3_loads;         // env_run switches that reloaded cr3
+	uint32_t cpu_cr3_skips;         // env_run switches that didn't need to
 };
 
 // Initialized in mpconfig.c
@@ -43,5 +45,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_dest(int apicid, int vector);
 
 #endif
@@ -14,12 +14,55 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/kmem.h>
+#include <kern/rmap.h>
 
-struct Env *envs = NULL;		// All environments
+struct Env *env_chunks[NENV / ENVS_PER_CHUNK];	// All environments
+size_t nenvs;					// Slots in env_chunks
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+// Environments that env_free has handed to the reaper, oldest first
+// (linked by Env->env_link). Their slots go back on env_free_list only
+// once the reaper has given back all of their memory.
+static struct Env *reap_list;
+static struct Env **reap_tail = &reap_list;
+static uintptr_t reap_va;		// How far into reap_list's address space
+					// the reaper has got
+
+// Address space teardown statistics, for 'envinfo'
+static struct {
+	uint32_t ts_handoffs;		// Environments handed to the reaper
+	uint64_t ts_cycles;		// Total time env_free spent on them
+	uint64_t ts_max_cycles;		// Longest single env_free
+	uint32_t ts_count;		// Address spaces torn down
+	uint64_t ts_pages;		// Pages unmapped doing it
+	uint32_t ts_batches;		// env_reap calls that did anything
+	uint64_t ts_reap_cycles;	// Total time spent reaping
+	uint64_t ts_reap_max_cycles;	// Longest single env_reap
+} teardown_stats;
+
+// Binary loading statistics, for 'envinfo'
+static struct {
+	uint32_t ls_count;		// Binaries loaded by load_icode
+	uint64_t ls_cycles;		// Time spent in load_icode
+	uint32_t ls_faults;		// Faults resolved by env_vm_fault
+	uint32_t ls_filled;		// Pages copied from binaries
+	uint32_t ls_zero;		// All-bss pages mapped to the zero page
+	uint32_t ls_around;		// Pages loaded by fault-around
+} load_stats;
+
+// Anonymous memory statistics, for 'envinfo'
+static struct {
+	uint32_t vs_reserves;		// Regions reserved
+	uint32_t vs_faults;		// Faults resolved in them
+	uint32_t vs_around;		// Pages mapped by their fault-around
+	uint32_t vs_grows;		// Times a stack grew
+	uint32_t vs_copies;		// EnvVms copied to be changed
+} vm_stats;
+
+static struct kmem_cache *env_vm_cache;
+int env_fault_around = ENV_FAULT_AROUND;
 
 // Global descriptor table.
 //
@@ -88,8 +131,13 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
-	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (envid < 0 || ENVX(envid) >= nenvs) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	e = env_at(ENVX(envid));
+	if (e->env_status == ENV_FREE || e->env_status == ENV_REAPING ||
+	    e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -108,23 +156,70 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
+// Add a chunk of environments to the end of the table, mapped
+// read-only for users at the end of what's at UENVS so far.
+// Mark them all as free, set their env_ids to just their index,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
 // they are in the envs array (i.e., so that the first call to
 // env_alloc() returns envs[0]) (I achieve this by looping backwards
-// through envs).
+// through the chunk).
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if the table already has NENV environments
+//	-E_NO_MEM on memory exhaustion
+//
+static int
+env_grow(void)
+{
+	struct PageInfo *pp;
+	struct Env *chunk;
+	int i, r;
+
+	if (nenvs == NENV)
+		return -E_NO_FREE_ENV;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	// mem_init made the page table for UENVS, and every environment's
+	// page directory shares it, so they all see the new chunk.
+	// Permissions: kernel R, user R (the kernel uses env_chunks),
+	// global like the rest of UENVS
+	r = page_insert(kern_pgdir, pp,
+			(void *) (UENVS + nenvs * sizeof(struct Env)),
+			PTE_U | PTE_G);
+	if (r < 0) {
+		page_free(pp);
+		return r;
+	}
+
+	chunk = page2kva(pp);
+	for (i = ENVS_PER_CHUNK - 1; i >= 0; i--) {
+		chunk[i].env_id = ENVID(0, nenvs + i);
+		chunk[i].env_status = ENV_FREE;
+		chunk[i].env_link = env_free_list;
+		env_free_list = &chunk[i];
+	}
+	env_chunks[nenvs / ENVS_PER_CHUNK] = chunk;
+	nenvs += ENVS_PER_CHUNK;
+	return 0;
+}
+
+// Start off the environment table with its first chunk.
 //
 void
 env_init(void)
 {
-	int i;
-	for (i = NENV - 1; i >= 0; i--) {
-		envs[i].env_id = 0;
-		envs[i].env_status = ENV_FREE;
-		envs[i].env_link = env_free_list;
-		env_free_list = &envs[i];
-	}
+	// A whole number of environments fit in a chunk, and NENV of
+	// them fit at UENVS
+	static_assert(PGSIZE % sizeof(struct Env) == 0);
+	static_assert(NENV * sizeof(struct Env) <= PTSIZE);
+
+	if (env_grow() < 0)
+		panic("env_init: out of memory");
+
+	if (!(env_vm_cache = kmem_cache_create("env_vm", sizeof(struct EnvVm))))
+		panic("env_init: out of memory");
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -164,35 +259,18 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i;
 	struct PageInfo *p = NULL;
 
-	// Allocate a page for the env's page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
-		return -E_NO_MEM;
-
+	// Get a page directory with the kernel's mappings (and UVPT)
+	// already in place, usually one from a freed environment.
 	// In general, pp_ref is not maintained for
 	// physical pages mapped only above UTOP, but env_pgdir
-	// is an exception -- you need to increment env_pgdir's
-	// pp_ref for env_free to work correctly.
-	p->pp_ref++;
+	// is an exception -- pgdir_alloc gives it a reference
+	// for env_free to drop.
+	if (!(p = pgdir_alloc()))
+		return -E_NO_MEM;
 
 	e->env_pgdir = (pde_t *)page2kva(p);
-
-	// Since all VAs are identical above UTOP (except
-	// the recursive mapping at UVPT), we copy the
-	// entirety of the kernel's PD, which is empty
-	// below UTOP, into the env's PD. This is why
-	// we place kernel data structures at high
-	// VAs in advance. Kernel's PD mappings are static
-	// after UENVS is mapped, so we can just copy it
-	// around.
-	memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
-
-	// UVPT maps the env's own page table read-only.
-	// Permissions: kernel R, user R
-	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
-
 	return 0;
 }
 
@@ -211,18 +289,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	// Out of free environments: grow the table, or failing that,
+	// wait for the reaper to finish with the ones it has
+	if (!env_free_list && (r = env_grow()) < 0) {
+		env_reap_all();
+		if (!env_free_list)
+			return r;
+	}
+	e = env_free_list;
 
 	// Allocate and set up the page directory for this environment.
 	if ((r = env_setup_vm(e)) < 0)
 		return r;
 
 	// Generate an env_id for this environment.
-	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
-	if (generation <= 0)	// Don't create a negative env_id.
-		generation = 1 << ENVGENSHIFT;
-	e->env_id = generation | (e - envs);
+	generation = (ENVGEN(e->env_id) + 1) & ((1 << ENVGENBITS) - 1);
+	if (generation == 0)	// Don't reuse the free-slot ids.
+		generation = 1;
+	e->env_id = ENVID(generation, ENVX(e->env_id));
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
@@ -260,6 +344,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// No binary to page in, until load_icode or env_vm_share.
+	e->env_vm = NULL;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -268,58 +355,368 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+// Fill in the page at va (page-aligned) of e's binary, which isn't
+// mapped yet, from every segment that covers part of it. A page that's
+// all bss is mapped to the zero page, unless it's about to be written.
+//
+// Returns 0 on success, -E_FAULT if va isn't part of the binary, or
+// -E_NO_MEM.
+static int
+env_vm_fill(struct Env *e, uintptr_t va, bool write)
+{
+	struct EnvVm *vm = e->env_vm;
+	struct EnvSeg *es;
+	struct PageInfo *pp;
+	uintptr_t lo, hi;
+	bool file = false;
+	int i, r, perm = 0;
+	char *kva;
+
+	for (i = 0; i < vm->ev_nsegs; i++) {
+		es = &vm->ev_segs[i];
+		if (va < es->es_memend && va + PGSIZE > es->es_va) {
+			perm |= es->es_perm;
+			file |= va < es->es_fileend;
+		}
+	}
+	if (!perm)
+		return -E_FAULT;
+
+	if (!file && !write) {
+		if ((r = page_insert_zero(e->env_pgdir, (void *) va, perm)) < 0)
+			return r;
+		load_stats.ls_zero++;
+		return 0;
+	}
+
+	// The user only gets at the page through its own mappings, so it
+	// may as well come from high memory
+	if (!(pp = page_alloc_user(e->env_pgdir, va, ALLOC_ZERO | ALLOC_HIGH)))
+		return -E_NO_MEM;
+	kva = page_kmap(pp);
+	for (i = 0; i < vm->ev_nsegs; i++) {
+		es = &vm->ev_segs[i];
+		lo = MAX(va, es->es_va);
+		hi = MIN(va + PGSIZE, es->es_fileend);
+		if (lo < hi)
+			memcpy(kva + (lo - va), es->es_data + (lo - es->es_va), hi - lo);
+	}
+	page_kunmap(kva);
+
+	if ((r = page_insert(e->env_pgdir, pp, (void *) va, perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	load_stats.ls_filled++;
+	return 0;
+}
+
+// Does anything in 'vm', a page of a segment or of a region, overlap
+// [lo, hi)?
+static bool
+env_vm_overlaps(struct EnvVm *vm, uintptr_t lo, uintptr_t hi)
+{
+	struct EnvSeg *es;
+	struct EnvRegion *er;
+	int i;
+
+	for (i = 0; i < vm->ev_nsegs; i++) {
+		es = &vm->ev_segs[i];
+		if (lo < ROUNDUP(es->es_memend, PGSIZE) &&
+		    hi > ROUNDDOWN(es->es_va, PGSIZE))
+			return true;
+	}
+	for (i = 0; i < vm->ev_nregions; i++) {
+		er = &vm->ev_regions[i];
+		if (lo < er->er_end && hi > er->er_va)
+			return true;
+	}
+	return false;
+}
+
+// Make e's EnvVm its own, so it can be changed: a copy, if e shares it
+// with its relatives, or an empty one, if e has none. Returns NULL if
+// there's no memory for that.
+static struct EnvVm *
+env_vm_own(struct Env *e)
+{
+	struct EnvVm *vm;
+
+	if (e->env_vm && e->env_vm->ev_ref == 1)
+		return e->env_vm;
+
+	// Allocating may reap environments sharing it, so look again after
+	if (!(vm = kmem_cache_alloc(env_vm_cache)))
+		return NULL;
+	if (e->env_vm && e->env_vm->ev_ref == 1) {
+		kmem_cache_free(env_vm_cache, vm);
+		return e->env_vm;
+	}
+
+	if (e->env_vm) {
+		*vm = *e->env_vm;
+		e->env_vm->ev_ref--;
+		vm_stats.vs_copies++;
+	} else
+		memset(vm, 0, sizeof(*vm));
+	vm->ev_ref = 1;
+	return e->env_vm = vm;
+}
+
+// Find the region of e's that the page at va (page-aligned) is in. If
+// there's none, but va is below a stack, within ENV_STACK_MAX of its
+// top, and there's a page to spare between va and whatever else is
+// below the stack, grow the stack down to va first (if 'grow').
 //
-// Allocate len bytes of physical memory for environment env,
-// and map it at virtual address va in the environment's address space.
+// Returns 0 and sets *er_store on success, -E_FAULT if va isn't in a
+// region, or -E_NO_MEM if there's no memory to grow the stack.
+static int
+env_vm_region(struct Env *e, uintptr_t va, bool grow,
+	      struct EnvRegion **er_store)
+{
+	struct EnvVm *vm = e->env_vm;
+	struct EnvRegion *er;
+	int i;
+
+	for (i = 0; i < vm->ev_nregions; i++) {
+		er = &vm->ev_regions[i];
+		if (va >= er->er_va && va < er->er_end) {
+			*er_store = er;
+			return 0;
+		}
+	}
+	if (!grow)
+		return -E_FAULT;
+
+	for (i = 0; i < vm->ev_nregions; i++) {
+		er = &vm->ev_regions[i];
+		if ((er->er_flags & VM_GROWSDOWN) && va < er->er_va &&
+		    er->er_end - va <= ENV_STACK_MAX && va >= PGSIZE &&
+		    !env_vm_overlaps(vm, va - PGSIZE, er->er_va))
+			break;
+	}
+	if (i == vm->ev_nregions)
+		return -E_FAULT;
+
+	// Its relatives' stacks stay as they are
+	if (!(vm = env_vm_own(e)))
+		return -E_NO_MEM;
+	er = &vm->ev_regions[i];
+	er->er_va = va;
+	vm_stats.vs_grows++;
+	*er_store = er;
+	return 0;
+}
 
-// - Optionally zeroes the mapped pages
-// - Pages should be writable by user and kernel.
-// - Panic if any allocation attempt fails.
+// Fill in the page at va (page-aligned) of e's region 'er', which isn't
+// mapped yet: with the zero page, unless it's about to be written.
 //
-// va and len do not need to be page-aligned. region_alloc will round
-// va down and len up.
-static void
-region_alloc(struct Env *e, void *va, size_t len, int alloc_flags)
+// Returns 0 on success, or -E_NO_MEM.
+static int
+env_vm_anon(struct Env *e, struct EnvRegion *er, uintptr_t va, bool write)
 {
-	pte_t *pte_p;  // Pointer to PTE in e->env_pgdir
-	struct PageInfo *p;  // Pointer to newly allocated PageInfos
+	struct PageInfo *pp;
+	int r;
+
+	if (!write)
+		return page_insert_zero(e->env_pgdir, (void *) va, er->er_perm);
+
+	if (!(pp = page_alloc_user(e->env_pgdir, va, ALLOC_ZERO | ALLOC_HIGH)))
+		return -E_NO_MEM;
+	if ((r = page_insert(e->env_pgdir, pp, (void *) va, er->er_perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
+}
+
+// env_vm_fault, for a page in one of e's regions. Fault-around works as
+// it does for the binary, but only within the region, and with the
+// region's own number of pages, since memory mapped ahead of use here
+// isn't shared with anyone. The other pages get whatever the faulting
+// one did: pages of their own if it was written, so a buffer being
+// filled in takes one fault a block, or the zero page if it was read.
+static int
+env_vm_anon_fault(struct Env *e, struct EnvRegion *er, uintptr_t va,
+		  bool write)
+{
+	uintptr_t start, end;
+	unsigned around = VM_AROUND_PAGES(er->er_flags);
+	pte_t *pte_p;
+	int r;
+
+	if (write && !(er->er_perm & PTE_W))
+		return -E_FAULT;
+	if ((r = env_vm_anon(e, er, va, write)) < 0)
+		return r;
+	vm_stats.vs_faults++;
+
+	if (around <= 1)
+		return 0;
+	start = ROUNDDOWN(va, around * PGSIZE);
+	end = MIN(start + around * PGSIZE, er->er_end);
+	for (start = MAX(start, er->er_va); start < end; start += PGSIZE) {
+		pte_p = pgdir_walk(e->env_pgdir, (void *) start, 0);
+		if (pte_p && (*pte_p & PTE_P))
+			continue;
+		if (env_vm_anon(e, er, start, write) == 0)
+			vm_stats.vs_around++;
+	}
+	return 0;
+}
+
+//
+// Resolve a fault on a page of e's binary that hasn't been loaded yet,
+// or of a region it reserved with sys_vm_reserve (growing a stack to
+// cover it, if need be), at 'va'. 'err' is the page fault error code.
+//
+// With fault-around on (env_fault_around > 1), the other pages in the
+// same aligned block of env_fault_around pages are loaded too, if
+// they're part of the binary and not loaded yet: binaries tend to be
+// read sequentially, so that saves the faults they'd take. Failing to
+// load one of them is not an error. Regions have a fault-around of
+// their own (see env_vm_anon_fault).
+//
+// Returns 0 if the faulting access can be retried, -E_FAULT if va isn't
+// part of e's binary or regions, or -E_NO_MEM.
+//
+int
+env_vm_fault(struct Env *e, uintptr_t va, uint32_t err)
+{
+	struct EnvRegion *er;
+	uintptr_t start, end;
+	pte_t *pte_p;
+	int r;
+
+	if (!e->env_vm || va >= UTOP)
+		return -E_FAULT;
 
-	// Page-align va and len
 	va = ROUNDDOWN(va, PGSIZE);
-	len = ROUNDUP(len, PGSIZE);
+	if ((r = env_vm_region(e, va, true, &er)) == 0)
+		return env_vm_anon_fault(e, er, va, err & FEC_WR);
+	if (r != -E_FAULT)
+		return r;
+
+	if ((r = env_vm_fill(e, va, err & FEC_WR)) < 0)
+		return r;
+	load_stats.ls_faults++;
+
+	if (env_fault_around <= 1)
+		return 0;
+	start = ROUNDDOWN(va, env_fault_around * PGSIZE);
+	end = MIN(start + env_fault_around * PGSIZE, UTOP);
+	for (; start < end; start += PGSIZE) {
+		pte_p = pgdir_walk(e->env_pgdir, (void *) start, 0);
+		if (pte_p && (*pte_p & PTE_P))
+			continue;
+		if (env_vm_fill(e, start, false) == 0)
+			load_stats.ls_around++;
+	}
+	return 0;
+}
+
+//
+// Load whatever isn't loaded yet of e's binary and regions in
+// [start, end), so the kernel can check it's mapped before using it.
+// Pages that can't be loaded are left out, which the check will notice.
+// Region pages are mapped to the zero page, which counts as writable,
+// and stacks aren't grown.
+//
+void
+env_vm_populate(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct EnvSeg *es;
+	struct EnvRegion *er;
+	uintptr_t va, lo, hi;
+	pte_t *pte_p;
+	int i;
 
-	while (len) {
-		// Allocate a new physical page
-		if (!(p = page_alloc(alloc_flags)))
-			panic("Region allocation failed for Env at %x", e);
+	if (!e->env_vm)
+		return;
 
-		// Insert new page at va in env_pgdir, incr'ing its
-		// refcount.
-		if ((page_insert(e->env_pgdir, p, va, PTE_U | PTE_W)) < 0)
-			panic("Page insertion failed for Env: %x, va: %x ", e, va);
+	for (i = 0; i < e->env_vm->ev_nsegs; i++) {
+		es = &e->env_vm->ev_segs[i];
+		lo = ROUNDDOWN(MAX(start, es->es_va), PGSIZE);
+		hi = MIN(end, es->es_memend);
+		for (va = lo; va < hi; va += PGSIZE) {
+			pte_p = pgdir_walk(e->env_pgdir, (void *) va, 0);
+			if (!pte_p || !(*pte_p & PTE_P))
+				env_vm_fill(e, va, false);
+		}
+	}
 
-		va += PGSIZE;
-		len -= PGSIZE;
+	for (i = 0; i < e->env_vm->ev_nregions; i++) {
+		er = &e->env_vm->ev_regions[i];
+		lo = MAX(ROUNDDOWN(start, PGSIZE), er->er_va);
+		hi = MIN(end, er->er_end);
+		for (va = lo; va < hi; va += PGSIZE) {
+			pte_p = pgdir_walk(e->env_pgdir, (void *) va, 0);
+			if (!pte_p || !(*pte_p & PTE_P))
+				env_vm_anon(e, er, va, false);
+		}
 	}
 }
 
+//
+// Let 'child' page in the parts of its parent's binary that the parent
+// never loaded, and so couldn't hand down.
+//
+void
+env_vm_share(struct Env *child, struct Env *parent)
+{
+	if ((child->env_vm = parent->env_vm))
+		child->env_vm->ev_ref++;
+}
+
+//
+// Reserve [va, va+len) (page-aligned, below UTOP) in e's address space
+// for anonymous memory with permission 'perm', filled in with zeroed
+// pages as it's faulted on; see sys_vm_reserve, which checks the
+// arguments, for the flags.
+//
+// Returns 0 on success, -E_INVAL if the range overlaps the binary or
+// another region, or -E_NO_MEM if e has ENV_NREGIONS regions already or
+// there's no memory to record another.
+//
+int
+env_vm_reserve(struct Env *e, uintptr_t va, size_t len, int perm, int flags)
+{
+	struct EnvVm *vm;
+	struct EnvRegion *er;
+
+	if (e->env_vm && env_vm_overlaps(e->env_vm, va, va + len))
+		return -E_INVAL;
+	if (e->env_vm && e->env_vm->ev_nregions == ENV_NREGIONS)
+		return -E_NO_MEM;
+	if (!(vm = env_vm_own(e)))
+		return -E_NO_MEM;
+
+	er = &vm->ev_regions[vm->ev_nregions++];
+	er->er_va = va;
+	er->er_end = va + len;
+	er->er_perm = perm;
+	er->er_flags = flags;
+	vm_stats.vs_reserves++;
+	return 0;
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
 // This function is ONLY called during kernel initialization,
 // before running the first user-mode environment.
 //
-// This function loads all loadable segments from the ELF binary image
-// into the environment's user memory, starting at the appropriate
-// virtual addresses indicated in the ELF program header.
-// At the same time it clears to zero any portions of these segments
-// that are marked in the program header as being mapped
-// but not actually present in the ELF file - i.e., the program's bss section.
-// These sections are indicated in program headers where filesz < memsz.
-
-// ELF segments are not necessarily page-aligned, but you can
-// assume for this function that no two segments will touch
-// the same virtual page.
+// This function records the loadable segments from the ELF binary image,
+// which are then paged in from the image at the appropriate virtual
+// addresses indicated in the ELF program header as the environment
+// touches them (see env_vm_fault). At the same time it clears to zero
+// any portions of these segments that are marked in the program header
+// as being mapped but not actually present in the ELF file - i.e., the
+// program's bss section. These sections are indicated in program headers
+// where filesz < memsz.
+//
+// ELF segments are not necessarily page-aligned, and two of them may
+// share a page, in which case that page is filled in from both.
 //
 // TODO Build in some security checks so users can't load malicious
 // code into the kernel. See page 36 of
@@ -327,47 +724,58 @@ region_alloc(struct Env *e, void *va, size_t len, int alloc_flags)
 static void
 load_icode(struct Env *e, uint8_t *binary)
 {
+	uint64_t start = read_tsc();
 	struct Elf *elfhdr = (struct Elf *)binary;
 	if (elfhdr->e_magic != ELF_MAGIC)
 		panic("Binary not ELF at %x", binary);
 
-	// Activate env's PD for the rest of this
-	// function. Since it's a superset of kern_pgdir,
-	// all high kernel VAs will still map correctly,
-	// and low VAs (any VA that's written to) will
-	// map to the env's physical pages.
-	lcr3(PADDR(e->env_pgdir));
-
-	// Get a pointer to the beginning of the executable's program
-	// header table (the first entry). This should still go onto
-	// the kernel's stack despite the `lcr3` call above, because
-	// we haven't touched the kernel's $esp register.
+	struct EnvVm *vm = kmem_cache_alloc(env_vm_cache);
+	if (!vm)
+		panic("No memory to load binary at %x", binary);
+	vm->ev_ref = 1;
+	vm->ev_nsegs = 0;
+	vm->ev_nregions = 0;
+
+	// Get a pointer to the beginning of the program header table
+	// (the first entry).
 	struct Proghdr *ph = (struct Proghdr *)(binary + elfhdr->e_phoff);
 
-	// Loop through program header table entries, loading
-	// the right ones into env's virtual memory
+	// Loop through program header table entries, recording the
+	// ones that are loaded into env's virtual memory
 	uint16_t i;
+	struct EnvSeg *es;
 	for (i = elfhdr->e_phnum; i > 0; i--, ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
 
-		// Allocate and zero-out new physical pages for segment at
-		// specified VA in env's address space
-		region_alloc(e, (void *)ph->p_va, ph->p_memsz, ALLOC_ZERO);
-
-		// Copy program segment into the appropriate VA. Since we've
-		// set `cr3` to e's PD it'll get written to e's physical pages.
-		memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
+		if (ph->p_filesz > ph->p_memsz || ph->p_va >= UTOP ||
+		    ph->p_memsz > UTOP - ph->p_va)
+			panic("Bad segment at %x in binary at %x", ph->p_va, binary);
+		if (vm->ev_nsegs == ENV_NSEGS)
+			panic("Too many segments in binary at %x", binary);
+
+		es = &vm->ev_segs[vm->ev_nsegs++];
+		es->es_va = ph->p_va;
+		es->es_fileend = ph->p_va + ph->p_filesz;
+		es->es_memend = ph->p_va + ph->p_memsz;
+		es->es_data = binary + ph->p_offset;
+		es->es_perm = PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			es->es_perm |= PTE_W;
 	}
+	e->env_vm = vm;
 
-	// Map one page for the program's initial stack
-	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE, ALLOC_ZERO);
+	// Reserve a page for the program's initial stack, which it gets
+	// when it first pushes something, and which grows from there
+	if (env_vm_reserve(e, USTACKTOP - PGSIZE, PGSIZE, PTE_P | PTE_U | PTE_W,
+			   VM_GROWSDOWN) < 0)
+		panic("Stack overlaps binary at %x", binary);
 
 	// Set program's EIP to binary's entry point
 	e->env_tf.tf_eip = elfhdr->e_entry;
 
-	// Re-activate kernel's PD
-	lcr3(PADDR(kern_pgdir));
+	load_stats.ls_count++;
+	load_stats.ls_cycles += read_tsc() - start;
 }
 
 //
@@ -391,56 +799,183 @@ env_create(uint8_t *binary, enum EnvType type)
 }
 
 //
-// Frees env e and all memory it uses.
+// Frees env e. Its memory is given back by the reaper (see env_reap),
+// a bit at a time, so this takes the same short time however big e is.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	uint64_t start = read_tsc(), cycles;
 
 	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
+	// before the reaper frees the page directory, just in case the
+	// page gets reused.
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	// Let go of the binary
+	if (e->env_vm && --e->env_vm->ev_ref == 0)
+		kmem_cache_free(env_vm_cache, e->env_vm);
+	e->env_vm = NULL;
+
+	// Queue the rest for the reaper. envid2env won't find e from
+	// now on, and nothing will run it.
+	e->env_status = ENV_REAPING;
+	e->env_link = NULL;
+	*reap_tail = e;
+	reap_tail = &e->env_link;
+
+	cycles = read_tsc() - start;
+	teardown_stats.ts_handoffs++;
+	teardown_stats.ts_cycles += cycles;
+	if (cycles > teardown_stats.ts_max_cycles)
+		teardown_stats.ts_max_cycles = cycles;
+}
 
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
+//
+// Tear down about 'budget' pages' worth of the address spaces env_free
+// has queued, oldest first, giving the memory back a page table at a
+// time. The TLB invalidations and page frees for each page table are
+// batched by pte_range. An environment whose address space is all gone
+// goes back on env_free_list.
+// Called from the scheduler, a batch per sched_yield or idle CPU.
+//
+// Returns true if there's still work left to do.
+//
+bool
+env_reap(int budget)
+{
+	struct PteRange r;
+	struct Env *e;
+	pte_t *pte_p;
+	uint64_t start, cycles;
+	uint32_t npages = 0;
+	physaddr_t pa;
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
+	if (!reap_list)
+		return false;
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+	start = read_tsc();
+	static_assert(UTOP % PTSIZE == 0);
+	while ((e = reap_list) && npages < budget) {
+		// Flush all mapped pages in the user portion of the address
+		// space (huge pages included), then free the emptied page
+		// table (which pools it for reuse), leaving the user half of
+		// the page directory clear as well. Huge page PDEs are
+		// cleared by pte_range_remove. A page table still shared
+		// with another environment since a fork is left to it,
+		// mappings and all.
+		for (; reap_va < UTOP && npages < budget; reap_va += PTSIZE) {
+			if (!(e->env_pgdir[PDX(reap_va)] & PTE_P))
+				continue;
+			pa = PTE_ADDR(e->env_pgdir[PDX(reap_va)]);
+			if (pde_is_shared(e->env_pgdir[PDX(reap_va)]) &&
+			    pa2page(pa)->pp_ref > 1) {
+				rmap_remove(pa2page(pa), &e->env_pgdir[PDX(reap_va)]);
+				e->env_pgdir[PDX(reap_va)] = 0;
+				tlb_flush_pgdir(e->env_pgdir);
+				page_table_free(pa2page(pa));
+				npages++;
+				continue;
+			}
+			pte_range_begin(&r, e->env_pgdir, reap_va, PTSIZE, 0);
+			while ((pte_p = pte_range_next(&r))) {
+				pte_range_remove(&r, pte_p);
+				npages++;
+			}
+			pte_range_end(&r);
+
+			if (!(e->env_pgdir[PDX(reap_va)] & PTE_P))
+				continue;
+			pa = PTE_ADDR(e->env_pgdir[PDX(reap_va)]);
+			rmap_remove(pa2page(pa), &e->env_pgdir[PDX(reap_va)]);
+			e->env_pgdir[PDX(reap_va)] = 0;
+			page_table_free(pa2page(pa));
 		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		if (reap_va < UTOP)
+			break;
+
+		// free the page directory, which is ready for the next
+		// environment as it is
+		pa = PADDR(e->env_pgdir);
+		e->env_pgdir = 0;
+		pgdir_free(pa2page(pa));
+
+		// return the environment to the free list
+		if (!(reap_list = e->env_link))
+			reap_tail = &reap_list;
+		reap_va = 0;
+		e->env_status = ENV_FREE;
+		e->env_link = env_free_list;
+		env_free_list = e;
+		teardown_stats.ts_count++;
 	}
 
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
-	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+	cycles = read_tsc() - start;
+	teardown_stats.ts_pages += npages;
+	teardown_stats.ts_batches++;
+	teardown_stats.ts_reap_cycles += cycles;
+	if (cycles > teardown_stats.ts_reap_max_cycles)
+		teardown_stats.ts_reap_max_cycles = cycles;
+	return reap_list != NULL;
+}
 
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+//
+// Is there anything for env_reap to do?
+//
+bool
+env_reap_pending(void)
+{
+	return reap_list != NULL;
+}
+
+//
+// Finish tearing down every address space env_free has queued.
+// For when the memory or the Env slots are needed right away.
+//
+void
+env_reap_all(void)
+{
+	while (env_reap(REAP_BATCH))
+		/* do nothing */;
+}
+
+//
+// Print address space teardown statistics.
+//
+void
+print_env_stats(void)
+{
+	cprintf("env_free: %u", teardown_stats.ts_handoffs);
+	if (teardown_stats.ts_handoffs)
+		cprintf(", %llu cycles average, %llu max",
+			teardown_stats.ts_cycles / teardown_stats.ts_handoffs,
+			teardown_stats.ts_max_cycles);
+	cprintf("\nteardowns: %u done, %s, pages unmapped: %llu\n",
+		teardown_stats.ts_count, reap_list ? "more queued" : "none queued",
+		teardown_stats.ts_pages);
+	if (teardown_stats.ts_batches)
+		cprintf("reaper: %u batches, %llu cycles average, %llu max\n",
+			teardown_stats.ts_batches,
+			teardown_stats.ts_reap_cycles / teardown_stats.ts_batches,
+			teardown_stats.ts_reap_max_cycles);
+
+	cprintf("binaries loaded: %u", load_stats.ls_count);
+	if (load_stats.ls_count)
+		cprintf(", %llu cycles average to load",
+			load_stats.ls_cycles / load_stats.ls_count);
+	cprintf("\nbinary page faults: %u, fault-around: %d pages\n",
+		load_stats.ls_faults, env_fault_around);
+	cprintf("pages loaded: %u copied, %u zero, %u by fault-around\n",
+		load_stats.ls_filled, load_stats.ls_zero, load_stats.ls_around);
+	cprintf("regions reserved: %u, faults in them: %u, pages by "
+		"fault-around: %u\n", vm_stats.vs_reserves, vm_stats.vs_faults,
+		vm_stats.vs_around);
+	cprintf("stacks grown: %u times, layouts copied: %u\n",
+		vm_stats.vs_grows, vm_stats.vs_copies);
 }
 
 //
@@ -479,7 +1014,19 @@ env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
+	trapframe_pop(tf);
+}
 
+//
+// The 'iret' half of env_pop_tf, for going back from a trap to whatever
+// it interrupted, which needn't be an environment: a T_TLBSHOOT can
+// interrupt the hlt in sched_halt, where curenv is NULL.
+//
+// This function does not return.
+//
+void
+trapframe_pop(struct Trapframe *tf)
+{
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -522,7 +1069,17 @@ env_run(struct Env *e)
 	e->env_runs++;
 	curenv = e;
 
-	lcr3(PADDR(e->env_pgdir));
+	// Reloading cr3 flushes every non-global TLB entry, so don't
+	// bother when we're already on the right page directory, like when
+	// sched_yield picks the environment that just yielded.
+	if (rcr3() != PADDR(e->env_pgdir)) {
+		lcr3(PADDR(e->env_pgdir));
+		thiscpu->cpu_cr3_loads++;
+	} else
+		thiscpu->cpu_cr3_skips++;
+
+	// From here on, other CPUs interrupt us for TLB shootdowns
+	tlb_enter_user();
 
 	unlock_kernel();
 
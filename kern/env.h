@@ -6,7 +6,62 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 
-extern struct Env *envs;		// All environments
+// Most loadable segments a binary may have
+#define ENV_NSEGS		8
+
+// Most regions an environment may reserve with sys_vm_reserve, its stack
+// included
+#define ENV_NREGIONS		16
+
+// Most a stack (a VM_GROWSDOWN region) may grow to
+#define ENV_STACK_MAX		(256 * PGSIZE)
+
+// Default for env_fault_around: a fault on a page of the binary loads
+// the rest of the aligned block of this many pages along with it
+#define ENV_FAULT_AROUND	16
+
+// Pages the reaper unmaps per env_reap call, give or take a page table
+// (it finishes whichever page table it's in)
+#define REAP_BATCH		256
+
+// A loadable ELF segment, paged in from the kernel's copy of the binary
+struct EnvSeg {
+	uintptr_t es_va;		// Start of the segment in memory
+	uintptr_t es_fileend;		// End of the part from the file
+	uintptr_t es_memend;		// End of the segment; the rest is bss
+	const uint8_t *es_data;		// Contents of [es_va, es_fileend)
+	int es_perm;			// PTE_U, and PTE_W if it's writable
+};
+
+// Anonymous memory reserved with sys_vm_reserve, given zeroed pages as
+// it's faulted on
+struct EnvRegion {
+	uintptr_t er_va;		// Start; a stack's moves down as it grows
+	uintptr_t er_end;		// End
+	int er_perm;			// As for sys_page_alloc
+	int er_flags;			// VM_GROWSDOWN, VM_AROUND(n)
+};
+
+// The binary an environment was created from, and the regions it has
+// reserved. Nothing is copied into its address space up front; pages
+// are filled in as they're faulted on. Environments share it with their
+// children, who fault in whatever their parent never touched, until
+// one of them changes it and gets a copy of its own (see env_vm_own).
+struct EnvVm {
+	int ev_ref;			// Environments sharing this
+	int ev_nsegs;			// Entries used in ev_segs
+	struct EnvSeg ev_segs[ENV_NSEGS];
+	int ev_nregions;		// Entries used in ev_regions
+	struct EnvRegion ev_regions[ENV_NREGIONS];
+};
+
+// The environment table, a page ("chunk") of struct Envs at a time.
+// User environments see it all in one piece, as envs[] at UENVS.
+#define ENVS_PER_CHUNK	(PGSIZE / sizeof(struct Env))
+
+extern struct Env *env_chunks[];	// Kernel address of each chunk
+extern size_t nenvs;			// Environment slots so far
+extern int env_fault_around;		// Pages env_vm_fault loads per fault
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -16,16 +71,34 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+bool	env_reap(int budget);
+bool	env_reap_pending(void);
+void	env_reap_all(void);
+void	print_env_stats(void);
+
+int	env_vm_fault(struct Env *e, uintptr_t va, uint32_t err);
+int	env_vm_reserve(struct Env *e, uintptr_t va, size_t len, int perm,
+		       int flags);
+void	env_vm_populate(struct Env *e, uintptr_t start, uintptr_t end);
+void	env_vm_share(struct Env *child, struct Env *parent);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
+void	trapframe_pop(struct Trapframe *tf) __attribute__((noreturn));
 
 // Without this extra macro, we couldn't pass macros like TEST to
 // ENV_CREATE because of the C pre-processor's argument prescan rule.
 #define ENV_PASTE3(x, y, z) x ## y ## z
 
+// The environment with index 'envx' (see ENVX), which must be < nenvs
+static inline struct Env *
+env_at(size_t envx)
+{
+	return &env_chunks[envx / ENVS_PER_CHUNK][envx % ENVS_PER_CHUNK];
+}
+
 #define ENV_CREATE(x, type)						\
 	do {								\
 		extern uint8_t ENV_PASTE3(_binary_obj_, x, _start)[];	\
@@ -7,6 +7,9 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/ksm.h>
+#include <kern/rmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -36,10 +39,14 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
+	rmap_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	ksm_init();
 	trap_init();
+	check_tlb_shootdown();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -107,6 +114,8 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
 	lcr3(PADDR(kern_pgdir));
+	// Keep TLB entries for the kernel's global mappings across lcr3
+	lcr4(rcr4() | CR4_PGE);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
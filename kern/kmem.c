@@ -0,0 +1,339 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator for fixed-size kernel objects.
+//
+// Each kmem_cache hands out objects of one size, carved out of whole
+// pages ("slabs") from page_alloc. A slab starts with a small header,
+// followed by as many objects as fit in the rest of the page; free
+// objects in a slab are linked through their first word. Since a slab
+// is exactly one page, the slab an object belongs to is found by just
+// rounding the object's address down to a page boundary.
+//
+// A cache keeps its slabs on three lists, by how many of their objects
+// are in use: partial slabs are allocated from first, then empty ones,
+// and only then is a new page taken. One empty slab is kept around so
+// a cache that's hovering around a slab boundary doesn't keep taking
+// and returning the same page; any others go back to page_free.
+//
+// Like the rest of the kernel, this relies on the big kernel lock.
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+struct Slab {
+	struct Slab *s_next;		// Next slab on the same list
+	struct Slab **s_pprev;		// Whatever points at us on that list
+	struct kmem_cache *s_cache;	// Cache this slab belongs to
+	void *s_free;			// Free objects in this slab
+	int s_inuse;			// Number of objects handed out
+};
+
+struct kmem_cache {
+	char kc_name[KMEM_NAMELEN];
+	size_t kc_objsize;		// Object size, padded for alignment
+	size_t kc_offset;		// Offset of the first object in a slab
+	int kc_perslab;			// Objects per slab
+	struct Slab *kc_partial;	// Slabs with some objects in use
+	struct Slab *kc_full;		// Slabs with every object in use
+	struct Slab *kc_empty;		// Slabs with no objects in use
+	struct kmem_cache *kc_next;	// Next cache on kmem_caches
+
+	// Statistics, reported by the 'kmeminfo' monitor command
+	int kc_nslabs;			// Pages held by this cache
+	int kc_inuse;			// Objects currently handed out
+	uint32_t kc_nalloc;		// Total kmem_cache_alloc calls served
+	uint32_t kc_nfree;		// Total kmem_cache_free calls
+};
+
+// The cache that kmem_cache structures themselves are allocated from.
+// It can't come from kmem_cache_create, so it's set up by hand.
+static struct kmem_cache cache_cache;
+
+// Every cache, for 'kmeminfo'
+static struct kmem_cache *kmem_caches;
+
+static void check_kmem(void);
+
+static void
+slab_push(struct Slab **list, struct Slab *slab)
+{
+	slab->s_next = *list;
+	slab->s_pprev = list;
+	if (*list)
+		(*list)->s_pprev = &slab->s_next;
+	*list = slab;
+}
+
+static void
+slab_unlink(struct Slab *slab)
+{
+	*slab->s_pprev = slab->s_next;
+	if (slab->s_next)
+		slab->s_next->s_pprev = slab->s_pprev;
+	slab->s_next = NULL;
+	slab->s_pprev = NULL;
+}
+
+// Move 'slab' onto whichever of its cache's lists matches how many of
+// its objects are now in use.
+static void
+slab_relist(struct kmem_cache *cache, struct Slab *slab)
+{
+	slab_unlink(slab);
+	if (slab->s_inuse == 0)
+		slab_push(&cache->kc_empty, slab);
+	else if (slab->s_inuse == cache->kc_perslab)
+		slab_push(&cache->kc_full, slab);
+	else
+		slab_push(&cache->kc_partial, slab);
+}
+
+// Take a new page for 'cache' and carve it into free objects.
+// Returns NULL if out of memory.
+static struct Slab *
+slab_grow(struct kmem_cache *cache)
+{
+	struct PageInfo *pp;
+	struct Slab *slab;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_ref++;
+
+	slab = page2kva(pp);
+	slab->s_cache = cache;
+	slab->s_inuse = 0;
+	slab->s_free = NULL;
+
+	// Link up the free objects so they're handed out in address order
+	for (i = cache->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *) slab + cache->kc_offset + i * cache->kc_objsize;
+		*(void **) obj = slab->s_free;
+		slab->s_free = obj;
+	}
+
+	slab_push(&cache->kc_empty, slab);
+	cache->kc_nslabs++;
+	return slab;
+}
+
+// Give an empty slab's page back to the page allocator.
+static void
+slab_release(struct kmem_cache *cache, struct Slab *slab)
+{
+	slab_unlink(slab);
+	cache->kc_nslabs--;
+	page_decref(pa2page(PADDR(slab)));
+}
+
+static void
+kmem_cache_init(struct kmem_cache *cache, const char *name, size_t size)
+{
+	size_t objsize;
+
+	// Free objects hold the free list link
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	// Pad small objects up to a power of two, so they pack evenly into
+	// cache lines, and big ones up to a whole number of cache lines.
+	if (size >= KMEM_ALIGN)
+		objsize = ROUNDUP(size, KMEM_ALIGN);
+	else
+		for (objsize = sizeof(void *); objsize < size; objsize <<= 1)
+			/* do nothing */;
+
+	memset(cache, 0, sizeof(*cache));
+	strncpy(cache->kc_name, name, KMEM_NAMELEN - 1);
+	cache->kc_objsize = objsize;
+	cache->kc_offset = ROUNDUP(sizeof(struct Slab), KMEM_ALIGN);
+	if (cache->kc_offset + objsize > PGSIZE)
+		panic("kmem_cache_create: %s: %u-byte objects don't fit in a slab",
+		      name, size);
+	cache->kc_perslab = (PGSIZE - cache->kc_offset) / objsize;
+
+	cache->kc_next = kmem_caches;
+	kmem_caches = cache;
+}
+
+//
+// Set up the slab allocator. Call after mem_init.
+//
+void
+kmem_init(void)
+{
+	kmem_cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+	check_kmem();
+}
+
+//
+// Create a cache of 'size'-byte objects, called 'name' in 'kmeminfo'.
+// Objects must fit in a page, less the slab header.
+//
+// Returns NULL if out of memory.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size)
+{
+	struct kmem_cache *cache;
+
+	if (!(cache = kmem_cache_alloc(&cache_cache)))
+		return NULL;
+	kmem_cache_init(cache, name, size);
+	return cache;
+}
+
+//
+// Destroy a cache, giving back all of its pages.
+// Every object allocated from it must have been freed already.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cache)
+{
+	struct kmem_cache **cp;
+
+	if (cache->kc_inuse)
+		panic("kmem_cache_destroy: %s still has %d objects in use",
+		      cache->kc_name, cache->kc_inuse);
+
+	while (cache->kc_empty)
+		slab_release(cache, cache->kc_empty);
+
+	for (cp = &kmem_caches; *cp != cache; cp = &(*cp)->kc_next)
+		/* do nothing */;
+	*cp = cache->kc_next;
+
+	kmem_cache_free(&cache_cache, cache);
+}
+
+//
+// Allocate an object from 'cache'. Its contents are undefined.
+//
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct Slab *slab;
+	void *obj;
+
+	if (!(slab = cache->kc_partial) && !(slab = cache->kc_empty) &&
+	    !(slab = slab_grow(cache)))
+		return NULL;
+
+	obj = slab->s_free;
+	slab->s_free = *(void **) obj;
+	slab->s_inuse++;
+	slab_relist(cache, slab);
+
+	cache->kc_inuse++;
+	cache->kc_nalloc++;
+	return obj;
+}
+
+//
+// Return an object allocated from 'cache' by kmem_cache_alloc.
+//
+void
+kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct Slab *slab = ROUNDDOWN(obj, PGSIZE);
+	size_t off = (char *) obj - (char *) slab;
+
+	if (slab->s_cache != cache || off < cache->kc_offset ||
+	    (off - cache->kc_offset) % cache->kc_objsize != 0)
+		panic("kmem_cache_free: %08x is not an object from %s",
+		      obj, cache->kc_name);
+
+	*(void **) obj = slab->s_free;
+	slab->s_free = obj;
+	slab->s_inuse--;
+	cache->kc_inuse--;
+	cache->kc_nfree++;
+
+	// Keep one empty slab around, but no more
+	if (slab->s_inuse == 0 && cache->kc_empty)
+		slab_release(cache, slab);
+	else
+		slab_relist(cache, slab);
+}
+
+//
+// Print usage of every slab cache.
+//
+void
+print_kmem_stats(void)
+{
+	struct kmem_cache *cache;
+
+	cprintf("cache             objsize  inuse/total  slabs  allocs     frees\n");
+	for (cache = kmem_caches; cache; cache = cache->kc_next)
+		cprintf("%-16s  %7u  %5d/%-5d  %5d  %-9u  %-9u\n",
+			cache->kc_name, cache->kc_objsize, cache->kc_inuse,
+			cache->kc_nslabs * cache->kc_perslab, cache->kc_nslabs,
+			cache->kc_nalloc, cache->kc_nfree);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *big, *small;
+	char *objs[PGSIZE / KMEM_ALIGN + 1];
+	char *obj;
+	int i, n;
+
+	// big objects are padded to whole cache lines
+	assert((big = kmem_cache_create("check_big", 100)));
+	assert(big->kc_objsize == 128);
+	n = big->kc_perslab;
+	assert(n == (PGSIZE - big->kc_offset) / 128);
+
+	// one more object than fits in a slab takes a second slab
+	for (i = 0; i <= n; i++) {
+		assert((objs[i] = kmem_cache_alloc(big)));
+		assert((uintptr_t) objs[i] % KMEM_ALIGN == 0);
+		memset(objs[i], i, 100);
+	}
+	assert(big->kc_nslabs == 2 && big->kc_inuse == n + 1);
+	assert(ROUNDDOWN(objs[0], PGSIZE) == ROUNDDOWN(objs[n - 1], PGSIZE));
+	assert(ROUNDDOWN(objs[0], PGSIZE) != ROUNDDOWN(objs[n], PGSIZE));
+	for (i = 0; i <= n; i++)
+		assert(objs[i][0] == (char) i && objs[i][99] == (char) i);
+
+	// freed objects are reused, and only one empty slab is kept
+	obj = objs[3];
+	kmem_cache_free(big, obj);
+	assert((objs[3] = kmem_cache_alloc(big)) == obj);
+	for (i = 0; i <= n; i++)
+		kmem_cache_free(big, objs[i]);
+	assert(big->kc_nslabs == 1 && big->kc_inuse == 0);
+
+	// small objects are padded to a power of two, never crossing a line
+	assert((small = kmem_cache_create("check_small", 24)));
+	assert(small->kc_objsize == 32);
+	for (i = 0; i < 8; i++) {
+		assert((objs[i] = kmem_cache_alloc(small)));
+		assert((uintptr_t) objs[i] / KMEM_ALIGN ==
+		       ((uintptr_t) objs[i] + 23) / KMEM_ALIGN);
+	}
+	for (i = 0; i < 8; i++)
+		kmem_cache_free(small, objs[i]);
+
+	kmem_cache_destroy(small);
+	kmem_cache_destroy(big);
+	assert(kmem_caches == &cache_cache && cache_cache.kc_inuse == 0);
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Objects are laid out so that none straddles a cache line: objects of
+// at least KMEM_ALIGN bytes start on a line of their own, and smaller
+// ones are padded to a power of two that evenly divides a line.
+#define KMEM_ALIGN	64
+
+// Longest cache name kmem_cache_create keeps, including the NUL
+#define KMEM_NAMELEN	32
+
+struct kmem_cache;
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void	kmem_cache_destroy(struct kmem_cache *cache);
+void *	kmem_cache_alloc(struct kmem_cache *cache);
+void	kmem_cache_free(struct kmem_cache *cache, void *obj);
+void	print_kmem_stats(void);
+
+#endif	// !JOS_KERN_KMEM_H
@@ -0,0 +1,443 @@
+/* See COPYRIGHT for copyright information. */
+
+// Kernel same-page merging.
+//
+// Environments created from the same binary, or forked from each other,
+// often end up with byte-identical pages in separate frames: each copy
+// of a program's text loaded by env_create, or data pages that several
+// children copied on write and then left alike. When a CPU has nothing
+// to run, ksm_scan walks user address spaces a few pages at a time,
+// hashes each candidate page, and maps identical ones to a single frame.
+//
+// Only pages that can't change are merged: read-only mappings, either
+// plain or copy-on-write (PTE_COW, see lib/fork.c), of frames nothing
+// else maps. Such a frame can never be written again, since any new
+// mapping of it has to be read-only too (sys_page_map won't add PTE_W
+// to a read-only page), and the kernel writes to user memory through
+// user mappings only. So a merged frame keeps its contents for as long
+// as it lives, and an environment that wants to write to its copy gets
+// a page fault, just as it would have before the merge.
+//
+// Pages are tracked in two hash tables keyed by content:
+//
+//  - The stable table holds merged frames (PP_KSM). A page that matches
+//    one of these is simply remapped to it. A merged frame leaves the
+//    table when its last mapping goes away (see ksm_page_freed).
+//
+//  - The unstable table holds pages seen so far in the current pass
+//    over all environments, recorded by where they're mapped rather
+//    than by frame, since they may be unmapped at any time. A page that
+//    matches one of these, after checking that it's still mapped, turns
+//    it into a stable frame and is remapped to it. The unstable table
+//    is thrown away at the end of every pass.
+//
+// Like the rest of the kernel, this relies on the big kernel lock.
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/env.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/env.h>
+#include <kern/ksm.h>
+#include <kern/rmap.h>
+
+struct KsmNode {
+	struct KsmNode *kn_next;	// Next node in the same bucket
+	uint32_t kn_hash;		// Hash of the page's contents
+	struct PageInfo *kn_page;	// The page
+	envid_t kn_envid;		// Unstable only: environment mapping it
+	uintptr_t kn_va;		// Unstable only: where it's mapped
+};
+
+static struct kmem_cache *ksm_node_cache;
+static struct KsmNode *ksm_stable[KSM_NBUCKETS];
+static struct KsmNode *ksm_unstable[KSM_NBUCKETS];
+
+// Where the next ksm_scan picks up
+static int ksm_envx;
+static uintptr_t ksm_va;
+
+// Statistics, reported by the 'ksminfo' monitor command
+static struct {
+	uint32_t ks_nshared;		// Frames in the stable table
+	uint32_t ks_nscanned;		// Candidate pages hashed
+	uint32_t ks_nmerged;		// Mappings moved to a merged frame
+	uint32_t ks_npasses;		// Passes over all environments
+	uint64_t ks_cycles;		// Time spent in ksm_scan
+} ksm_stats;
+
+static void check_ksm(void);
+
+//
+// Set up page merging. Call after kmem_init.
+//
+void
+ksm_init(void)
+{
+	if (!(ksm_node_cache = kmem_cache_create("ksm_node", sizeof(struct KsmNode))))
+		panic("ksm_init: out of memory");
+	check_ksm();
+}
+
+// FNV-1a, a word at a time.
+static uint32_t
+ksm_hash(struct PageInfo *pp)
+{
+	uint32_t *p = page_kmap(pp);
+	uint32_t hash = 2166136261;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		hash = (hash ^ p[i]) * 16777619;
+	page_kunmap(p);
+	return hash;
+}
+
+static bool
+ksm_same(struct PageInfo *a, struct PageInfo *b)
+{
+	void *ka = page_kmap(a);
+	void *kb = page_kmap(b);
+	bool same = memcmp(ka, kb, PGSIZE) == 0;
+
+	page_kunmap(kb);
+	page_kunmap(ka);
+	return same;
+}
+
+// Can the page 'pte' maps be merged? It must be a read-only user
+// mapping of a single page that nothing else maps (see above).
+static bool
+ksm_candidate(pte_t pte)
+{
+	struct PageInfo *pp;
+
+	if ((pte & (PTE_P | PTE_U | PTE_W | PTE_PS)) != (PTE_P | PTE_U))
+		return false;
+	if (PGNUM(PTE_ADDR(pte)) >= npages)
+		return false;
+	pp = pa2page(PTE_ADDR(pte));
+	return pp->pp_ref == 1 && pp->pp_order == 0 && !(pp->pp_flags & PP_KSM);
+}
+
+// The page an unstable node records, or NULL if it's no longer mapped
+// there (or no longer a candidate).
+static struct PageInfo *
+ksm_unstable_page(struct KsmNode *kn)
+{
+	struct Env *e;
+	pte_t *pte;
+
+	if (ENVX(kn->kn_envid) >= nenvs)
+		return NULL;
+	e = env_at(ENVX(kn->kn_envid));
+	if (e->env_id != kn->kn_envid || e->env_status == ENV_FREE ||
+	    e->env_status == ENV_DYING || e->env_status == ENV_REAPING)
+		return NULL;
+	if (!(pte = pgdir_walk(e->env_pgdir, (void *) kn->kn_va, 0)) ||
+	    !ksm_candidate(*pte) || pa2page(PTE_ADDR(*pte)) != kn->kn_page)
+		return NULL;
+	return kn->kn_page;
+}
+
+// Find a merged frame with the same contents as 'pp'.
+static struct PageInfo *
+ksm_stable_find(struct PageInfo *pp, uint32_t hash)
+{
+	struct KsmNode *kn;
+
+	for (kn = ksm_stable[hash % KSM_NBUCKETS]; kn; kn = kn->kn_next)
+		if (kn->kn_hash == hash && kn->kn_page->pp_ref < KSM_MAXREF &&
+		    ksm_same(kn->kn_page, pp))
+			return kn->kn_page;
+	return NULL;
+}
+
+// Find a page seen earlier in this pass with the same contents as 'pp',
+// and make it a merged frame. Drops any stale nodes on the way.
+static struct PageInfo *
+ksm_unstable_find(struct PageInfo *pp, uint32_t hash)
+{
+	struct KsmNode **knp, *kn;
+	struct PageInfo *up;
+	int b = hash % KSM_NBUCKETS;
+
+	for (knp = &ksm_unstable[b]; (kn = *knp); ) {
+		if (!(up = ksm_unstable_page(kn))) {
+			*knp = kn->kn_next;
+			kmem_cache_free(ksm_node_cache, kn);
+			continue;
+		}
+		if (kn->kn_hash == hash && up != pp && ksm_same(up, pp)) {
+			*knp = kn->kn_next;
+			kn->kn_next = ksm_stable[b];
+			ksm_stable[b] = kn;
+			up->pp_flags |= PP_KSM;
+			ksm_stats.ks_nshared++;
+			return up;
+		}
+		knp = &kn->kn_next;
+	}
+	return NULL;
+}
+
+static void
+ksm_unstable_reset(void)
+{
+	struct KsmNode *kn;
+	int i;
+
+	for (i = 0; i < KSM_NBUCKETS; i++)
+		while ((kn = ksm_unstable[i])) {
+			ksm_unstable[i] = kn->kn_next;
+			kmem_cache_free(ksm_node_cache, kn);
+		}
+}
+
+// Look at the page 'pte' (the entry r last returned) maps, in e.
+static void
+ksm_scan_page(struct PteRange *r, struct Env *e, pte_t *pte)
+{
+	struct PageInfo *pp, *kp;
+	struct KsmNode *kn;
+	uint32_t hash;
+
+	// Pages in a page table shared since a fork are left until it's
+	// e's own: other address spaces would see the entry change.
+	if (!ksm_candidate(*pte) || pde_is_shared(e->env_pgdir[PDX(r->pr_va)]))
+		return;
+	pp = pa2page(PTE_ADDR(*pte));
+	hash = ksm_hash(pp);
+	ksm_stats.ks_nscanned++;
+
+	if ((kp = ksm_stable_find(pp, hash)) ||
+	    (kp = ksm_unstable_find(pp, hash))) {
+		// Keep the permissions (including PTE_COW), change the frame.
+		// The old frame is freed once no TLB can still reach it. If
+		// there's no memory to note the new mapping, leave it be.
+		// Noting it may reap the environments that map kp, so take
+		// the new mapping's reference first, to keep kp meanwhile.
+		kp->pp_ref++;
+		if (rmap_add(kp, pte) < 0) {
+			page_decref(kp);
+			return;
+		}
+		rmap_remove(pp, pte);
+		*pte = page2pa(kp) | (*pte & 0xFFF);
+		pte_range_invalidate(r);
+		pte_range_put(r, pp);
+		ksm_stats.ks_nmerged++;
+		return;
+	}
+
+	// First of its kind this pass. If there's no memory for a node,
+	// the page just won't be merged with anything this time around.
+	if (!(kn = kmem_cache_alloc(ksm_node_cache)))
+		return;
+	kn->kn_hash = hash;
+	kn->kn_page = pp;
+	kn->kn_envid = e->env_id;
+	kn->kn_va = r->pr_va;
+	kn->kn_next = ksm_unstable[hash % KSM_NBUCKETS];
+	ksm_unstable[hash % KSM_NBUCKETS] = kn;
+}
+
+//
+// Scan e's address space from 'va' up, for at most '*budget' page table
+// entries, merging what can be merged. Takes what it used out of
+// *budget, and returns where to pick up again, or UTOP when done.
+//
+uintptr_t
+ksm_scan_env(struct Env *e, uintptr_t va, int *budget)
+{
+	struct PteRange r;
+	pte_t *pte;
+
+	pte_range_begin(&r, e->env_pgdir, va, UTOP - va, 0);
+	while (*budget > 0 && (pte = pte_range_next(&r))) {
+		(*budget)--;
+		ksm_scan_page(&r, e, pte);
+	}
+	va = r.pr_left ? r.pr_next : UTOP;
+	pte_range_end(&r);
+	return va;
+}
+
+//
+// Do a little merging. Called by idle CPUs from sched_halt.
+//
+// Environments that are running on another CPU are skipped, as are
+// ones being torn down; they'll be looked at on the next pass.
+//
+void
+ksm_scan(void)
+{
+	uint64_t start = read_tsc();
+	int budget = KSM_BATCH;
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < nenvs && budget > 0; i++) {
+		e = env_at(ksm_envx);
+		if (e->env_status == ENV_RUNNABLE ||
+		    e->env_status == ENV_NOT_RUNNABLE)
+			ksm_va = ksm_scan_env(e, ksm_va, &budget);
+		else
+			ksm_va = UTOP;
+		if (ksm_va < UTOP)
+			break;
+
+		// On to the next environment, or the next pass
+		ksm_va = 0;
+		if (++ksm_envx >= nenvs) {
+			ksm_envx = 0;
+			ksm_unstable_reset();
+			ksm_stats.ks_npasses++;
+			break;
+		}
+	}
+	ksm_stats.ks_cycles += read_tsc() - start;
+}
+
+//
+// Called by page_free_order when the last mapping of a merged frame
+// goes away. Its contents haven't changed, so neither has its hash.
+//
+void
+ksm_page_freed(struct PageInfo *pp)
+{
+	struct KsmNode **knp, *kn;
+
+	for (knp = &ksm_stable[ksm_hash(pp) % KSM_NBUCKETS]; (kn = *knp);
+	     knp = &kn->kn_next)
+		if (kn->kn_page == pp) {
+			*knp = kn->kn_next;
+			kmem_cache_free(ksm_node_cache, kn);
+			pp->pp_flags &= ~PP_KSM;
+			ksm_stats.ks_nshared--;
+			return;
+		}
+	panic("ksm_page_freed: %08x is not a merged page", page2pa(pp));
+}
+
+//
+// Print how much merging has saved, and what it cost.
+//
+void
+print_ksm_stats(void)
+{
+	struct KsmNode *kn;
+	uint32_t nsharing = 0;
+	int i;
+
+	for (i = 0; i < KSM_NBUCKETS; i++)
+		for (kn = ksm_stable[i]; kn; kn = kn->kn_next)
+			nsharing += kn->kn_page->pp_ref;
+
+	cprintf("merged frames: %u, mapped %u times, pages saved: %u\n",
+		ksm_stats.ks_nshared, nsharing, nsharing - ksm_stats.ks_nshared);
+	cprintf("passes: %u, pages hashed: %u, merges: %u\n",
+		ksm_stats.ks_npasses, ksm_stats.ks_nscanned, ksm_stats.ks_nmerged);
+	if (ksm_stats.ks_nscanned)
+		cprintf("scan time: %llu cycles, %llu per page hashed\n",
+			ksm_stats.ks_cycles,
+			ksm_stats.ks_cycles / ksm_stats.ks_nscanned);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+// Map a fresh page filled with 'c' at va in e.
+static struct PageInfo *
+check_ksm_map(struct Env *e, uintptr_t va, int c, int perm)
+{
+	struct PageInfo *pp;
+
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), c, PGSIZE);
+	assert(page_insert(e->env_pgdir, pp, (void *) va, perm) == 0);
+	return pp;
+}
+
+static void
+check_ksm(void)
+{
+	const uintptr_t va = 0x800000;
+	struct Env *a = env_at(0), *b = env_at(1), *e;
+	struct Env saved[2];
+	struct PageInfo *pp, *p1, *p2, *pw;
+	pte_t *pte;
+	int budget, i;
+
+	// Borrow the first two (free) slots of envs, so ksm_unstable_page
+	// can find them, and put them back on the free list as they were
+	// afterwards
+	for (i = 0; i < 2; i++) {
+		e = env_at(i);
+		saved[i] = *e;
+		memset(e, 0, sizeof(*e));
+		e->env_id = ENVID(1, i);
+		e->env_status = ENV_NOT_RUNNABLE;
+		assert((pp = page_alloc(ALLOC_ZERO)));
+		pp->pp_ref++;
+		e->env_pgdir = page2kva(pp);
+	}
+
+	// a has two different read-only pages
+	p1 = check_ksm_map(a, va, 0x5a, PTE_U);
+	p2 = check_ksm_map(a, va + PGSIZE, 0x33, PTE_U);
+
+	// b has three copies of the first: read-only, copy-on-write, and
+	// writable, which must be left alone
+	check_ksm_map(b, va, 0x5a, PTE_U);
+	check_ksm_map(b, va + PGSIZE, 0x5a, PTE_U | PTE_COW);
+	pw = check_ksm_map(b, va + 2 * PGSIZE, 0x5a, PTE_U | PTE_W);
+
+	// Scanning a finds nothing to merge with yet
+	budget = 100;
+	assert(ksm_scan_env(a, 0, &budget) == UTOP && budget == 98);
+	assert(ksm_stats.ks_nscanned == 2 && ksm_stats.ks_nmerged == 0);
+
+	// Scanning b merges its first two pages into a's first
+	budget = 100;
+	assert(ksm_scan_env(b, 0, &budget) == UTOP);
+	assert(ksm_stats.ks_nmerged == 2 && ksm_stats.ks_nshared == 1);
+	assert((p1->pp_flags & PP_KSM) && p1->pp_ref == 3);
+	assert(!(p2->pp_flags & PP_KSM) && p2->pp_ref == 1);
+	assert(page_lookup(b->env_pgdir, (void *) va, &pte) == p1);
+	assert((*pte & (PTE_W | PTE_COW)) == 0);
+	assert(page_lookup(b->env_pgdir, (void *) (va + PGSIZE), &pte) == p1);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(page_lookup(b->env_pgdir, (void *) (va + 2 * PGSIZE), &pte) == pw);
+	assert(*pte & PTE_W);
+
+	// The budget is honored, and the scan picks up where it left off
+	budget = 1;
+	assert(ksm_scan_env(b, 0, &budget) == va + PGSIZE && budget == 0);
+
+	// Unmapping the last copy of a merged page forgets about it
+	for (i = 0; i < 3; i++) {
+		page_remove(a->env_pgdir, (void *) (va + i * PGSIZE));
+		page_remove(b->env_pgdir, (void *) (va + i * PGSIZE));
+	}
+	assert(ksm_stats.ks_nshared == 0 && !(p1->pp_flags & PP_KSM));
+
+	// Clean up
+	ksm_unstable_reset();
+	for (i = 0; i < 2; i++) {
+		e = env_at(i);
+		assert(e->env_pgdir[PDX(va)] == 0);	// freed once empty
+		page_decref(pa2page(PADDR(e->env_pgdir)));
+		*e = saved[i];
+	}
+	memset(&ksm_stats, 0, sizeof(ksm_stats));
+
+	cprintf("check_ksm() succeeded!\n");
+}
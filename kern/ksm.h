@@ -0,0 +1,30 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Buckets in each of the stable and unstable hash tables
+#define KSM_NBUCKETS	512
+
+// User pages looked at per ksm_scan call, so an idle CPU that's woken
+// up to run an environment doesn't spend long getting to it
+#define KSM_BATCH	32
+
+// Stop merging into a page before its pp_ref could overflow
+#define KSM_MAXREF	0x8000
+
+struct Env;
+
+void	ksm_init(void);
+void	ksm_scan(void);
+uintptr_t ksm_scan_env(struct Env *e, uintptr_t va, int *budget);
+void	ksm_page_freed(struct PageInfo *pp);
+void	print_ksm_stats(void);
+
+#endif	// !JOS_KERN_KSM_H
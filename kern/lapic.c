@@ -180,3 +180,14 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an inter-processor interrupt to just the CPU with the given
+// local APIC ID.
+void
+lapic_ipi_dest(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -11,6 +11,13 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/ksm.h>
+#include <kern/rmap.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/syscall.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,6 +33,17 @@ static struct Command commands[] = {
 	{ "backtrace", "Display a stack backtrace", mon_backtrace },
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "pageinfo", "Display physical page allocator statistics", mon_pageinfo },
+	{ "kmeminfo", "Display slab cache usage", mon_kmeminfo },
+	{ "tlbinfo", "Display address space switch and TLB shootdown stats", mon_tlbinfo },
+	{ "envinfo", "Display environment address space statistics", mon_envinfo },
+	{ "faultaround", "Show or set how many pages a binary page fault loads", mon_faultaround },
+	{ "pagecolor", "Show or set whether user pages are cache coloured", mon_pagecolor },
+	{ "ksminfo", "Display same-page merging savings and scan cost", mon_ksminfo },
+	{ "rmapinfo", "Display reverse mapping cost, or where a frame is mapped", mon_rmapinfo },
+	{ "kcow", "Show or set whether the kernel breaks copy-on-write itself", mon_kcow },
+	{ "forkeager", "Show or set how many written pages fork copies up front", mon_forkeager },
+	{ "forkshare", "Show or set whether fork shares page tables copy-on-write", mon_forkshare },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -98,6 +116,168 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_pageinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	print_page_stats();
+	return 0;
+}
+
+int
+mon_kmeminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	print_kmem_stats();
+	return 0;
+}
+
+int
+mon_tlbinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	int i;
+
+	cprintf("cpu  cr3 loads  cr3 skips\n");
+	for (i = 0; i < ncpu; i++)
+		cprintf("%3d  %-9u  %-9u\n", i,
+			cpus[i].cpu_cr3_loads, cpus[i].cpu_cr3_skips);
+	print_tlb_stats();
+	return 0;
+}
+
+int
+mon_envinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	print_env_stats();
+	print_syscall_stats();
+	return 0;
+}
+
+int
+mon_faultaround(int argc, char **argv, struct Trapframe *tf)
+{
+	char *end;
+	long n;
+
+	if (argc == 2) {
+		n = strtol(argv[1], &end, 0);
+		if (*end || n < 0 || n > NPTENTRIES) {
+			cprintf("Usage: faultaround [npages, at most %d]\n", NPTENTRIES);
+			return 0;
+		}
+		env_fault_around = n;
+	}
+	cprintf("fault-around: %d pages\n", env_fault_around);
+	return 0;
+}
+
+int
+mon_pagecolor(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		page_color_enable(true);
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		page_color_enable(false);
+	else if (argc != 1) {
+		cprintf("Usage: pagecolor [on|off]\n");
+		return 0;
+	}
+	print_page_stats();
+	return 0;
+}
+
+int
+mon_forkeager(int argc, char **argv, struct Trapframe *tf)
+{
+	char *end;
+	long n;
+
+	if (argc == 2) {
+		n = strtol(argv[1], &end, 0);
+		if (*end || n < 0 || n > NPTENTRIES) {
+			cprintf("Usage: forkeager [npages, at most %d]\n", NPTENTRIES);
+			return 0;
+		}
+		page_fork_eager = n;
+	}
+	cprintf("fork copies up to %d written pages up front\n", page_fork_eager);
+	return 0;
+}
+
+int
+mon_forkshare(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		page_fork_share = true;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		page_fork_share = false;
+	else if (argc != 1) {
+		cprintf("Usage: forkshare [on|off]\n");
+		return 0;
+	}
+	cprintf("fork %s page tables\n", page_fork_share ? "shares" : "copies");
+	return 0;
+}
+
+int
+mon_ksminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	print_ksm_stats();
+	return 0;
+}
+
+// Print one of a frame's mappings, for 'rmapinfo'
+static int
+print_rmap(pde_t *pgdir, uintptr_t va, pte_t *pte, void *arg)
+{
+	int i;
+
+	for (i = 0; i < nenvs; i++)
+		if (env_at(i)->env_pgdir == pgdir &&
+		    env_at(i)->env_status != ENV_FREE)
+			break;
+	if (i < nenvs)
+		cprintf("  [%08x] ", env_at(i)->env_id);
+	else
+		cprintf("  pgdir %08x ", PADDR(pgdir));
+	cprintf("va %08x, pte %08x\n", va, *pte);
+	return 0;
+}
+
+int
+mon_rmapinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	physaddr_t pa;
+	char *end;
+
+	if (argc == 1) {
+		print_rmap_stats();
+		return 0;
+	}
+	pa = strtol(argv[1], &end, 16);
+	if (argc != 2 || *end || PGNUM(pa) >= npages) {
+		cprintf("Usage: rmapinfo [physical address, in hex]\n");
+		return 0;
+	}
+	cprintf("frame %08x, %d references:\n", ROUNDDOWN(pa, PGSIZE),
+		pa2page(pa)->pp_ref);
+	rmap_walk(pa2page(pa), print_rmap, NULL);
+	return 0;
+}
+
+int
+mon_kcow(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		page_cow_kernel = true;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		page_cow_kernel = false;
+	else if (argc != 1) {
+		cprintf("Usage: kcow [on|off]\n");
+		return 0;
+	}
+	print_page_stats();
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
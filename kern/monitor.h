@@ -15,5 +15,16 @@ void monitor(struct Trapframe *tf);
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
+int mon_pageinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_envinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_faultaround(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecolor(int argc, char **argv, struct Trapframe *tf);
+int mon_ksminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kcow(int argc, char **argv, struct Trapframe *tf);
+int mon_forkeager(int argc, char **argv, struct Trapframe *tf);
+int mon_forkshare(int argc, char **argv, struct Trapframe *tf);
+int mon_rmapinfo(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -5,11 +5,15 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/ksm.h>
+#include <kern/rmap.h>
 
 
 // --------------------------------------------------------------
@@ -24,12 +28,57 @@ nvram_read(int r)
 
 // Set by i386_detect_memory
 size_t npages;			// Amount of physical memory (in pages)
+size_t npages_direct;		// Pages the KERNBASE map reaches
 static size_t npages_basemem;	// Amount of base memory (in pages)
 
+// Our copy of the BIOS memory map that boot.S left at E820_MAP
+static struct E820Map e820;
+
+// Physical addresses past 4GB are no use to us without PAE
+#define E820_ADDR_LIMIT	0x100000000ULL
+
+static const char *
+e820_type_name(uint32_t type)
+{
+	switch (type) {
+	case E820_RAM:		return "usable";
+	case E820_RESERVED:	return "reserved";
+	case E820_ACPI:		return "ACPI data";
+	case E820_NVS:		return "ACPI NVS";
+	default:		return "unknown";
+	}
+}
+
+// Does the BIOS memory map say all of physical page 'pfn' is RAM?
+// The page has to lie inside a RAM range and clear of every other
+// kind, since some BIOSes report ranges that overlap.
+static bool
+e820_page_is_ram(size_t pfn)
+{
+	uint64_t pa = (uint64_t) pfn << PGSHIFT;
+	struct E820Entry *ee;
+	bool ram = false;
+	uint32_t i;
+
+	for (i = 0; i < e820.em_nentries; i++) {
+		ee = &e820.em_entries[i];
+		if (pa + PGSIZE <= ee->ee_addr || pa >= ee->ee_addr + ee->ee_len)
+			continue;
+		if (ee->ee_type != E820_RAM)
+			return false;
+		if (ee->ee_addr <= pa && pa + PGSIZE <= ee->ee_addr + ee->ee_len)
+			ram = true;
+	}
+	return ram;
+}
+
 static void
 i386_detect_memory(void)
 {
-	size_t npages_extmem;
+	size_t npages_extmem, npages_max;
+	struct E820Entry *ee;
+	uint64_t start, end;
+	uint32_t i;
 
 	// Use CMOS calls to measure available base & extended memory.
 	// (CMOS calls return results in kilobytes.)
@@ -37,17 +86,57 @@ i386_detect_memory(void)
 	npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
 	npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
 
-	// Calculate the number of physical pages available in both base
-	// and extended memory.
-	if (npages_extmem)
+	// The CMOS only counts up to 64MB, and knows nothing of holes, so
+	// prefer the BIOS memory map if boot.S managed to get one. We
+	// can't use KADDR on it yet, but entry_pgdir maps it all the same.
+	memmove(&e820, (void *) (KERNBASE + E820_MAP), sizeof(e820));
+	if (e820.em_nentries > E820_NMAX)
+		e820.em_nentries = 0;
+
+	if (e820.em_nentries) {
+		// Memory ends with the highest RAM range; page_init leaves
+		// whatever holes there are below that alone.
+		npages = npages_extmem = 0;
+		for (i = 0; i < e820.em_nentries; i++) {
+			ee = &e820.em_entries[i];
+			start = MIN(ee->ee_addr, E820_ADDR_LIMIT);
+			end = MIN(ee->ee_addr + ee->ee_len, E820_ADDR_LIMIT);
+			if (start == end)
+				continue;
+			cprintf("  e820: [%08x, %08x] %s\n", (uint32_t) start,
+				(uint32_t) (end - 1), e820_type_name(ee->ee_type));
+			if (ee->ee_type != E820_RAM)
+				continue;
+			npages = MAX(npages, (size_t) (end >> PGSHIFT));
+			if (end > EXTPHYSMEM)
+				npages_extmem += (end - MAX(start, (uint64_t) EXTPHYSMEM)) >> PGSHIFT;
+		}
+	} else if (npages_extmem)
 		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
 	else
 		npages = npages_basemem;
 
+	// The 'pages' array has to fit in its PTSIZE window at UPAGES
+	npages_max = PTSIZE / sizeof(struct PageInfo);
+	if (npages > npages_max) {
+		cprintf("Physical memory: ignoring %uK past %uK\n",
+			(npages - npages_max) * (PGSIZE / 1024),
+			npages_max * (PGSIZE / 1024));
+		npages = npages_max;
+	}
+
+	// Only the first 256MB can be reached through KERNBASE. The rest
+	// is "high memory", which goes to user pages, and which the kernel
+	// maps as needed with page_kmap.
+	npages_direct = MIN(npages, (size_t) (-KERNBASE / PGSIZE));
+
 	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
-		npages * PGSIZE / 1024,
+		(npages_basemem + npages_extmem) * (PGSIZE / 1024),
 		npages_basemem * PGSIZE / 1024,  // Should be 64 pages on x86
-		npages_extmem * PGSIZE / 1024);
+		npages_extmem * (PGSIZE / 1024));
+	if (npages > npages_direct)
+		cprintf("Physical memory: %uK of it above the KERNBASE map\n",
+			(npages - npages_direct) * (PGSIZE / 1024));
 }
 
 
@@ -57,12 +146,24 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static int page_insert_huge(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
+static void check_pte_range(void);
 static void check_page_installed_pgdir(void);
+static void check_page_cache(void);
+static void check_zero_pool(void);
+static void check_vm_pool(void);
+static void check_kmap(void);
+static void check_zero_page(void);
+static void check_cow(void);
+static void check_fork_share(void);
+static void check_page_color(void);
+static void page_color_init(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system. It starts allocating from .end, which is the
@@ -80,7 +181,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -106,7 +207,8 @@ boot_alloc(uint32_t n)
 	// to a multiple of PGSIZE.
 	uint32_t alloc = ROUNDUP(n, PGSIZE);
 
-	if ((nextfree + alloc) > (char *)0xf0400000)
+	// Only the memory entry_pgdir maps is usable yet
+	if ((nextfree + alloc) > (char *) (KERNBASE + ENTRY_MAPSIZE))
 		panic("boot_alloc: Out of memory!");
 
 	result = nextfree;
@@ -129,13 +231,199 @@ boot_alloc(uint32_t n)
 // Paging data structures
 pde_t *kern_pgdir;		// Addr of start of kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;
+
+// Physical memory is split into zones by whether the kernel can reach
+// it through the KERNBASE map. Anything the kernel itself uses comes
+// from ZONE_NORMAL; ZONE_HIGH, everything above npages_direct, is only
+// handed out to ALLOC_HIGH requests, for user pages. The zone boundary
+// (256MB) is aligned to the biggest block, so no block straddles it,
+// and a block's buddy is always in the same zone.
+enum {
+	ZONE_NORMAL = 0,
+	ZONE_HIGH,
+	NZONES
+};
+
+static const char *zone_names[NZONES] = {
+	[ZONE_NORMAL] = "normal",
+	[ZONE_HIGH] = "high"
+};
+
+// Free physical memory, managed as a binary buddy allocator per zone.
+// free_area[z][k] lists zone z's free blocks of 2^k contiguous pages.
+// Every block is naturally aligned to its own size, so a block's buddy
+// (the block it merges with to form one of the next order up) is found
+// by flipping bit k of its page number.
+static struct FreeArea {
+	struct PageInfo *fa_list;	// Free blocks of this order
+	size_t fa_nfree;		// Number of blocks on fa_list
+	// Statistics, reported by the 'pageinfo' monitor command
+	uint32_t fa_nalloc;		// Blocks handed out at this order
+	uint32_t fa_nfreed;		// Blocks given back at this order
+	uint32_t fa_nsplit;		// Blocks of this order split in two
+	uint32_t fa_nmerge;		// Blocks of this order merged with their buddy
+} free_area[NZONES][PAGE_MAX_ORDER + 1];
+
+static size_t page_nfree;	// Number of free pages, across all orders
+static size_t zone_nfree[NZONES];	// The same, per zone
+
+// Pages of each CPU's kmap window in use, and the PTEs mapping them
+static int kmap_depth[NCPU];
+static pte_t *kmap_ptes;
+
+// Per-CPU caches ("magazines") of free single pages, in front of the
+// buddy allocator. Most allocations and frees are single pages, and
+// with a cache each CPU mostly recycles its own recently freed pages
+// instead of going to the shared free lists: they're only touched a
+// batch at a time, when a cache runs empty or overfills.
+//
+// Like everything else in the kernel these are protected by the big
+// kernel lock; a CPU only ever touches its own cache, except to drain
+// them all when memory runs out. Cached pages aren't PP_FREE, so the
+// buddy allocator won't merge with them.
+#define PCP_BATCH	16	// Pages moved to or from the free lists at once
+#define PCP_HIGH	(2 * PCP_BATCH)	// Drain a batch above this many
+
+static struct PageCache {
+	struct PageInfo *pc_list;	// Cached pages, linked by pp_link
+	int pc_count;			// Number of pages on pc_list
+	uint32_t pc_hits;		// Allocations served from the cache
+	uint32_t pc_misses;		// Allocations that had to refill it
+	uint32_t pc_drains;		// Batches given back to the free lists
+} __attribute__((aligned(64))) page_cache[NCPU];  // One cache line each
+
+// The caches are off until mem_init has finished checking the buddy
+// allocator, whose checks expect page_alloc to hand out exactly the
+// pages the free lists say it will.
+static bool page_cache_enabled;
+
+// Pool of single pages that are already zeroed, so page_alloc(ALLOC_ZERO)
+// can usually skip the memset. CPUs with nothing better to do top it up
+// from sched_halt. Once the pool drops below ZPOOL_LOW it's refilled all
+// the way to ZPOOL_HIGH, at most ZPOOL_BATCH pages per idle visit, so an
+// idle CPU doesn't bother for every page taken and doesn't sit on the
+// kernel lock for long either. Pooled pages are marked PP_ZERO.
+#define ZPOOL_LOW	32
+#define ZPOOL_HIGH	128
+#define ZPOOL_BATCH	16
+
+static struct PageInfo *zero_pool;	// Zeroed pages, linked by pp_link
+static int zero_pool_count;		// Number of pages on zero_pool
+static bool zero_pool_filling;		// Refilling up to ZPOOL_HIGH
+static uint32_t zero_pool_served;	// ALLOC_ZERO requests from the pool
+static uint32_t zero_pool_missed;	// ALLOC_ZERO requests zeroed inline
+
+// Per-CPU pools of ready-made page directories, with the kernel's half
+// already copied in and an empty user half, and of empty page tables.
+// They're refilled mostly by env_free: tearing down an address space
+// leaves its page tables and the user half of its page directory all
+// zero anyway, so they can be used again as they are. An idle CPU also
+// tops up its own page directory pool from sched_halt. This relies on
+// the kernel's part of kern_pgdir not changing once environments exist.
+#define PDPOOL_HIGH	8	// Page directories kept per CPU
+#define PTPOOL_HIGH	32	// Empty page tables kept per CPU
+
+static struct VmPool {
+	struct PageInfo *vp_pgdirs;	// Page directories, linked by pp_link
+	int vp_npgdirs;			// Number of pages on vp_pgdirs
+	struct PageInfo *vp_ptabs;	// Empty page tables, linked by pp_link
+	int vp_nptabs;			// Number of pages on vp_ptabs
+	uint32_t vp_pgdir_hits;		// pgdir_alloc calls served from the pool
+	uint32_t vp_pgdir_misses;	// pgdir_alloc calls that built one
+	uint32_t vp_ptab_hits;		// page_table_alloc calls from the pool
+	uint32_t vp_ptab_misses;	// page_table_alloc calls that zeroed one
+} __attribute__((aligned(64))) vm_pool[NCPU];	// One cache line each
+
+// The shared zero page. Demand-zero memory (bss, and sys_page_alloc) is
+// mapped to this one read-only frame, PTE_COW if it's meant to be
+// writable, and gets a page of its own on the first write (see
+// page_fault_resolve). It holds a reference of its own so it's never
+// freed.
+struct PageInfo *zero_page;
+static uint32_t zero_page_breaks;	// Private pages given out on write
+
+// Copy-on-write faults. page_fault_resolve breaks them itself, unless
+// page_cow_kernel is off, in which case they go to the environment's
+// own page fault handler (lib/fork.c's pgfault) as they used to.
+bool page_cow_kernel = true;
+static uint32_t cow_copies;		// Broken in the kernel by copying
+static uint32_t cow_reuses;		// Broken in the kernel by reusing the
+					// last reference
+static uint32_t cow_upcalls;		// Left to the environment
+
+// page_fork_range copies up to this many of the pages the parent has
+// written lately to the child up front, rather than have them both take
+// a copy-on-write fault on it straight away. 0 turns it off.
+int page_fork_eager = PAGE_FORK_EAGER;
+static uint32_t fork_eager_copies;	// Pages copied up front
+
+// page_fork_range shares the parent's page tables with the child whole,
+// copy-on-write, unless page_fork_share is off (see pde_is_shared).
+bool page_fork_share = true;
+static uint32_t ptab_shares;		// Page tables shared by fork
+static uint32_t ptab_copies;		// Unshared by copying
+static uint32_t ptab_reclaims;		// Unshared by taking back the
+					// last reference
+
+// Page tables page_remove freed because nothing was left in them
+static uint32_t ptab_empty_frees;
+
+// Page colouring. Frames whose numbers are equal modulo page_ncolors
+// ("have the same colour") compete for the same sets in the physically
+// indexed L2 cache. With colouring on, page_alloc_user gives consecutive
+// virtual pages of an address space consecutive colours, so a buffer as
+// big as the cache can sit in it without evicting itself, however the
+// free lists happen to be ordered. Free pages are binned by colour: a
+// bin is refilled from the buddy allocator with an aligned block of
+// page_ncolors pages, which holds one page of every colour, and freed
+// pages are binned again, up to COLOR_BIN_MAX per bin.
+#define COLOR_BIN_MAX	16
+
+static bool page_color_enabled;		// Off until mem_init is done
+static int page_ncolors = 1;		// A power of two; see page_color_init
+static int page_color_order;		// log2(page_ncolors)
+static struct ColorBin {
+	struct PageInfo *cb_list;	// Free pages of this colour
+	int cb_count;			// Number of pages on cb_list
+} color_bins[NZONES][PAGE_NCOLORS_MAX];
+static int color_nbinned;		// Pages in all the bins
+static uint32_t color_served;		// page_alloc_user calls coloured
+static uint32_t color_missed;		// ... that had to take any colour
+
+// TLB shootdowns. Each CPU has a queue of addresses other CPUs need it
+// to invalidate, because they changed page tables it may have cached
+// translations from. Past TLB_FLUSH_THRESHOLD addresses, it flushes the
+// whole TLB instead.
+
+static struct TlbQueue {
+	struct spinlock tq_lock;	// Protects the queue, not the stats
+	uintptr_t tq_va[TLB_FLUSH_THRESHOLD];	// Addresses to invalidate
+	int tq_nva;			// Number of addresses in tq_va
+	bool tq_flush_all;		// Too many: flush everything instead
+	uint32_t tq_seq;		// Bumped every time something's queued
+	volatile uint32_t tq_done;	// tq_seq as of the last drain
+	volatile uint32_t tq_in_user;	// Running in user mode, interruptible
+
+	// State of shootdowns *sent* by this CPU
+	int tq_batch;			// tlb_batch_begin nesting depth
+	uint32_t tq_targets;		// CPUs with work queued, as a bitmask
+} tlb_queue[NCPU];
+
+// Shootdown statistics, for 'tlbinfo'. Only updated under the kernel lock.
+static struct {
+	uint32_t ts_shootdowns;		// Shootdowns with any remote CPU
+	uint32_t ts_ipis;		// Interrupts sent to do them
+	uint32_t ts_full_flushes;	// Queues that overflowed into a full flush
+	uint64_t ts_cycles;		// Total time waiting for shootdowns
+	uint64_t ts_max_cycles;		// Longest shootdown
+} tlb_stats;
 
 void
 mem_init(void)
 {
 	uint32_t cr0;
 	size_t n;
+	int i;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -162,13 +450,9 @@ mem_init(void)
 	// array.  'npages' is the number of physical pages in memory.  Use memset
 	// to initialize all fields of each struct PageInfo to 0. `pp_link` and
 	// `pp_ref` are initialized in `page_init`
+	static_assert(sizeof(struct PageInfo) <= 16);
 	pages = (struct PageInfo *)boot_alloc(npages * sizeof(struct PageInfo));
-	memset(pages, 0, npages);
-
-	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	// envs is extern'd in kern/env.h
-	envs = (struct Env *)boot_alloc(NENV * sizeof(struct Env));
+	memset(pages, 0, npages * sizeof(struct PageInfo));
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -181,6 +465,7 @@ mem_init(void)
 	check_page_free_list(1);
 	check_page_alloc();
 	check_page();
+	check_pte_range();
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
@@ -200,18 +485,12 @@ mem_init(void)
 	);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the 'envs' array read-only by the user at linear address UENVS
-	// (ie. perm = PTE_U | PTE_P).
-	// Permissions:
-	//    - the new image at UENVS  -- kernel R, user R
-	//    - envs itself -- kernel RW, user NONE
-	boot_map_region(
-		kern_pgdir,
-		UENVS,
-		PTSIZE,
-		PADDR(envs),
-		PTE_U
-	);
+	// The environment table at UENVS is mapped a page at a time by
+	// env_init and env_alloc as it grows (see env_grow), so just make
+	// its page table now. Every environment's page directory copies
+	// this PDE, so they all see chunks that are added later.
+	if (!pgdir_walk(kern_pgdir, (void *) UENVS, 1))
+		panic("mem_init: no page table for UENVS");
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -238,7 +517,10 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	boot_map_region(
+	// This is all 4MB aligned, so map it with superpages: that's 64
+	// page directory entries instead of 64 page tables, and a TLB entry
+	// covers 4MB of the kernel's data instead of 4KB.
+	boot_map_region_large(
 		kern_pgdir,
 		KERNBASE,
 		// 2's complement of KERNBASE is 0x10000000,
@@ -273,8 +555,37 @@ mem_init(void)
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
 
+	// Keep TLB entries for the kernel's PTE_G mappings across lcr3.
+	// (The APs do the same in mp_main.)
+	lcr4(rcr4() | CR4_PGE);
+
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&tlb_queue[i].tq_lock, "tlb_queue");
+
+	// The kmap windows share the kernel stacks' page table, so they're
+	// in every environment's address space too.
+	kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_ptes);
+	check_kmap();
+
+	// From here on, single pages go through the per-CPU caches.
+	page_cache_enabled = true;
+	check_page_cache();
+	check_zero_pool();
+	check_vm_pool();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref++;
+	check_zero_page();
+	check_cow();
+	check_fork_share();
+
+	page_color_init();
+	check_page_color();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -316,14 +627,87 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept on the buddy
+// allocator's free lists, one list per block order.
 // --------------------------------------------------------------
 
+// Which zone a page belongs to
+static inline int
+page_zone(struct PageInfo *pp)
+{
+	return (size_t) (pp - pages) < npages_direct ? ZONE_NORMAL : ZONE_HIGH;
+}
+
+// Push the 2^order page block starting at pp onto its zone's
+// free_area[order].
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	struct FreeArea *fa = &free_area[page_zone(pp)][order];
+
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	pp->pp_link = fa->fa_list;
+	pp->pp_pprev = &fa->fa_list;
+	if (fa->fa_list)
+		fa->fa_list->pp_pprev = &pp->pp_link;
+	fa->fa_list = pp;
+	fa->fa_nfree++;
+}
+
+// Take the free block headed by pp off its free list.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	*pp->pp_pprev = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = pp->pp_pprev;
+	free_area[page_zone(pp)][pp->pp_order].fa_nfree--;
+
+	pp->pp_link = NULL;
+	pp->pp_pprev = NULL;
+	pp->pp_flags &= ~PP_FREE;
+}
+
+// Give the 2^order page block starting at pp back to the free lists,
+// merging it with its buddy for as long as the buddy is free too.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t pfn = pp - pages;
+	size_t buddy_pfn;
+	int zone = page_zone(pp);
+
+	page_nfree += 1 << order;
+	zone_nfree[zone] += 1 << order;
+
+	while (order < PAGE_MAX_ORDER) {
+		buddy_pfn = pfn ^ (1 << order);
+		if (buddy_pfn + (1 << order) > npages)
+			break;
+		// The buddy is only mergeable if it is a whole free block
+		// of the same order; if it's been split, some part of it
+		// is still in use.
+		if (!(pages[buddy_pfn].pp_flags & PP_FREE) ||
+		    pages[buddy_pfn].pp_order != order)
+			break;
+
+		buddy_unlink(&pages[buddy_pfn]);
+		free_area[zone][order].fa_nmerge++;
+
+		// The merged block starts at whichever buddy is lower.
+		pfn &= ~(1 << order);
+		order++;
+	}
+
+	buddy_push(&pages[pfn], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -360,12 +744,20 @@ page_init(void)
 
 	size_t i;
 
-	for (i = 1; i < npages; i++) {
+	// Free pages from the top of memory down. Each block that
+	// buddy_free pushes then starts below every block pushed before
+	// it, so every free list ends up sorted lowest address first.
+	// That matters until mem_init switches to kern_pgdir: entry_pgdir
+	// only maps the first ENTRY_MAPSIZE, and the pages handed out
+	// before then have to come from there.
+	for (i = npages - 1; i > 0; i--) {
 		if (
 			// 7th physical page (MPENTRY_PADDR) reserved for AP startup code in mpentry.S
 			(i == PGNUM(MPENTRY_PADDR)) ||
 			// IO Hole
-			(i >= PGNUM(IOPHYSMEM) && i < PGNUM(PADDR(boot_alloc(0))))
+			(i >= PGNUM(IOPHYSMEM) && i < PGNUM(PADDR(boot_alloc(0)))) ||
+			// Anything else the BIOS says isn't RAM
+			(e820.em_nentries && !e820_page_is_ram(i))
 		) {
 			// Mark as used
 			pages[i].pp_ref = 1;
@@ -373,258 +765,1996 @@ page_init(void)
 		} else {
 			// Mark as free
 			pages[i].pp_ref = 0;
-			pages[i].pp_link = page_free_list;
-			page_free_list = &pages[i];
+			buddy_free(&pages[i], 0);
 		}
 	}
 }
 
-// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
-// count of the page - the caller must do these if necessary (either explicitly
-// or via page_insert).
+// Take a free block of 2^order pages off zone's buddy free lists.
+// Searches upward from free_area[zone][order] for the smallest free
+// block that's big enough, and splits it in half until it's the right
+// size, handing the unused upper halves back to the lower free lists.
+// Returns NULL if there is no free block that large.
+static struct PageInfo *
+buddy_alloc(int order, int zone)
+{
+	struct FreeArea *area = free_area[zone];
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER; k++)
+		if (area[k].fa_list)
+			break;
+
+	// Out of free blocks this large
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = area[k].fa_list;
+	buddy_unlink(pp);
+
+	while (k > order) {
+		area[k].fa_nsplit++;
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+
+	pp->pp_order = order;
+	area[order].fa_nalloc++;
+	page_nfree -= 1 << order;
+	zone_nfree[zone] -= 1 << order;
+	return pp;
+}
+
+// Give up to 'n' pages from the cache 'pc' back to the buddy allocator.
+static void
+page_cache_drain(struct PageCache *pc, int n)
+{
+	struct PageInfo *pp;
+
+	while (n-- > 0 && (pp = pc->pc_list)) {
+		pc->pc_list = pp->pp_link;
+		pc->pc_count--;
+		pp->pp_link = NULL;
+		pp->pp_flags &= ~PP_PCP;
+		free_area[ZONE_NORMAL][0].fa_nfreed++;
+		buddy_free(pp, 0);
+	}
+}
+
+// Take a single page from this CPU's cache, refilling the cache with a
+// batch of pages from the buddy allocator if it's empty. If even that
+// comes up empty, the free pages may all be sitting in other CPUs'
+// caches, so pull those back in and try once more.
+// The caches only ever hold ZONE_NORMAL pages.
+static struct PageInfo *
+page_cache_alloc(void)
+{
+	struct PageCache *pc = &page_cache[cpunum()];
+	struct PageInfo *batch[PCP_BATCH];
+	struct PageInfo *pp;
+	int i, n;
+
+	if (pc->pc_list)
+		pc->pc_hits++;
+	else {
+		pc->pc_misses++;
+		for (n = 0; n < PCP_BATCH; n++)
+			if (!(batch[n] = buddy_alloc(0, ZONE_NORMAL)))
+				break;
+		if (n == 0) {
+			for (i = 0; i < NCPU; i++)
+				page_cache_drain(&page_cache[i], page_cache[i].pc_count);
+			return buddy_alloc(0, ZONE_NORMAL);
+		}
+		// Push in reverse, so the lowest page comes out first
+		for (i = n - 1; i >= 0; i--) {
+			batch[i]->pp_flags |= PP_PCP;
+			batch[i]->pp_link = pc->pc_list;
+			pc->pc_list = batch[i];
+		}
+		pc->pc_count += n;
+	}
+
+	pp = pc->pc_list;
+	pc->pc_list = pp->pp_link;
+	pc->pc_count--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_PCP;
+	return pp;
+}
+
+// Put a single page on this CPU's cache, giving a batch back to the
+// buddy allocator if the cache is getting too big.
+static void
+page_cache_free(struct PageInfo *pp)
+{
+	struct PageCache *pc = &page_cache[cpunum()];
+
+	pp->pp_flags |= PP_PCP;
+	pp->pp_link = pc->pc_list;
+	pc->pc_list = pp;
+	if (++pc->pc_count > PCP_HIGH) {
+		pc->pc_drains++;
+		page_cache_drain(pc, PCP_BATCH);
+	}
+}
+
+// Take a page off the zero pool, or return NULL if it's empty.
+static struct PageInfo *
+zero_pool_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = zero_pool))
+		return NULL;
+	zero_pool = pp->pp_link;
+	zero_pool_count--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_ZERO;
+	return pp;
+}
+
+// Give every page in the zero pool back to the page allocator.
+static void
+zero_pool_drain(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = zero_pool_pop()))
+		page_free(pp);
+}
+
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// Top up the pool of pre-zeroed pages. Called by CPUs that are about to
+// go idle in sched_halt; does at most ZPOOL_BATCH pages of work.
 //
-// Returns NULL if out of free memory.
-struct PageInfo *
-page_alloc(int alloc_flags)
+void
+page_zero_pool_fill(void)
+{
+	struct PageInfo *pp;
+	int n;
+
+	if (zero_pool_count < ZPOOL_LOW)
+		zero_pool_filling = true;
+	if (!zero_pool_filling)
+		return;
+
+	for (n = 0; n < ZPOOL_BATCH && zero_pool_count < ZPOOL_HIGH; n++) {
+		// Don't eat into the last of free memory just to have it zeroed
+		if (zone_nfree[ZONE_NORMAL] < ZPOOL_HIGH || !(pp = page_alloc(0)))
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		pp->pp_flags |= PP_ZERO;
+		pp->pp_link = zero_pool;
+		zero_pool = pp;
+		zero_pool_count++;
+	}
+
+	if (zero_pool_count >= ZPOOL_HIGH)
+		zero_pool_filling = false;
+}
+
+// Take a page off one of the lists in a VmPool, or return NULL if it's
+// empty.
+static struct PageInfo *
+vm_pool_pop(struct PageInfo **list, int *count)
 {
-	struct PageInfo *result = page_free_list;
+	struct PageInfo *pp;
 
-	// Out of free pages
-	if (!result)
+	if (!(pp = *list))
 		return NULL;
+	*list = pp->pp_link;
+	(*count)--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_VMPOOL;
+	return pp;
+}
 
-	// Update free list to point to next free page
-	page_free_list = page_free_list->pp_link;
+static void
+vm_pool_push(struct PageInfo **list, int *count, struct PageInfo *pp)
+{
+	pp->pp_flags |= PP_VMPOOL;
+	pp->pp_link = *list;
+	*list = pp;
+	(*count)++;
+}
 
-	// Zero out page
-	if (alloc_flags & ALLOC_ZERO)
-		memset(page2kva(result), 0, PGSIZE);
+// Give every page in every CPU's VmPool back to the page allocator.
+// Returns the number of pages freed.
+static int
+vm_pool_drain(void)
+{
+	struct VmPool *vp;
+	struct PageInfo *pp;
+	int i, n = 0;
 
-	// TODO How does this help prevent double-free bugs?
-	result->pp_link = NULL;
+	for (i = 0; i < NCPU; i++) {
+		vp = &vm_pool[i];
+		for (; (pp = vm_pool_pop(&vp->vp_pgdirs, &vp->vp_npgdirs)); n++)
+			page_free(pp);
+		for (; (pp = vm_pool_pop(&vp->vp_ptabs, &vp->vp_nptabs)); n++)
+			page_free(pp);
+	}
+	return n;
+}
 
-	return result;
+// Build a page directory from scratch, as pgdir_alloc hands them out.
+// Returns NULL if out of memory.
+static struct PageInfo *
+pgdir_new(void)
+{
+	struct PageInfo *pp;
+	pde_t *pgdir;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pgdir = page2kva(pp);
+
+	// Since all VAs are identical above UTOP (except the recursive
+	// mapping at UVPT), copy the kernel's half of kern_pgdir. This is
+	// why we place kernel data structures at high VAs in advance.
+	memset(pgdir, 0, PDX(UTOP) * sizeof(pde_t));
+	memcpy(&pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+	       (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+
+	// UVPT maps the env's own page table read-only.
+	// Permissions: kernel R, user R
+	pgdir[PDX(UVPT)] = page2pa(pp) | PTE_P | PTE_U;
+	return pp;
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Allocate a page directory for a new address space: the kernel's
+// mappings above UTOP, nothing below, and the directory itself at UVPT.
+// Unlike page_alloc, the page comes with a reference for the caller.
 //
-void
-page_free(struct PageInfo *pp)
+// Returns NULL if out of memory.
+//
+struct PageInfo *
+pgdir_alloc(void)
 {
-	// Fill this function in
-	// Hint: You may want to panic if pp->pp_ref is nonzero or
-	// pp->pp_link is not NULL.
-	if (pp->pp_ref || pp->pp_link)
-		panic("Bad free");
+	struct VmPool *vp = &vm_pool[cpunum()];
+	struct PageInfo *pp;
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	if ((pp = vm_pool_pop(&vp->vp_pgdirs, &vp->vp_npgdirs)))
+		vp->vp_pgdir_hits++;
+	else {
+		vp->vp_pgdir_misses++;
+		if (!(pp = pgdir_new()))
+			return NULL;
+	}
+	pp->pp_ref++;
+	return pp;
 }
 
 //
-// Decrement the reference count on a page,
-// freeing it if there are no more refs.
+// Drop a reference to a page directory from pgdir_alloc. Everything
+// below UTOP must already have been unmapped, and its PDEs cleared.
 //
 void
-page_decref(struct PageInfo* pp)
+pgdir_free(struct PageInfo *pp)
 {
-	if (--pp->pp_ref == 0)
+	struct VmPool *vp = &vm_pool[cpunum()];
+
+	if (--pp->pp_ref > 0)
+		return;
+	if (vp->vp_npgdirs < PDPOOL_HIGH)
+		vm_pool_push(&vp->vp_pgdirs, &vp->vp_npgdirs, pp);
+	else
 		page_free(pp);
 }
 
-// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
-// a pointer to the page table entry (PTE) for linear address 'va'.
-// This requires walking the two-level page table structure.
 //
-// The relevant page table page might not exist yet.
-// If this is true, and create == false, then pgdir_walk returns NULL.
-// Otherwise, pgdir_walk allocates a new page table page with page_alloc.
-//    - If the allocation fails, pgdir_walk returns NULL.
-//    - Otherwise, the new page's reference count is incremented,
-//			the page is cleared, and pgdir_walk returns a pointer into
-//			the new page table page.
+// Top up this CPU's pool of page directories. Called by CPUs that are
+// about to go idle in sched_halt.
 //
-// The x86 MMU checks permission bits in both the page directory
-// and the page table, so it's safe to leave permissions in the page
-// directory more permissive than strictly necessary.
-pte_t *
-pgdir_walk(pde_t *pgdir, const void *va, int create)
+void
+pgdir_pool_fill(void)
 {
-	// Get 32-bit page directory entry
-	pde_t pde = pgdir[PDX(va)];
-
-	if (!(pde & PTE_P)) {  // Page table doesn't exist
-		if (!create)
-			return NULL;
+	struct VmPool *vp = &vm_pool[cpunum()];
+	struct PageInfo *pp;
 
-		// Allocate a page for a new page table
-		struct PageInfo *pp = page_alloc(ALLOC_ZERO);
-		if (!pp)
-			return NULL;  // Page allocation fail
+	while (vp->vp_npgdirs < PDPOOL_HIGH) {
+		// As for the zero pool, leave the last of free memory be
+		if (zone_nfree[ZONE_NORMAL] < ZPOOL_HIGH || !(pp = pgdir_new()))
+			break;
+		vm_pool_push(&vp->vp_pgdirs, &vp->vp_npgdirs, pp);
+	}
+}
 
-		pp->pp_ref++;
+//
+// Allocate an empty page table. As with page_alloc, pp_ref is 0.
+//
+// Returns NULL if out of memory.
+//
+struct PageInfo *
+page_table_alloc(void)
+{
+	struct VmPool *vp = &vm_pool[cpunum()];
+	struct PageInfo *pp;
 
-		// Get physical address of page corresponding to newly
-		// freed PageInfo pointer, set some meta bits (according
-		// the PTE format), and save it as a new PDE in the page directory.
-		pde = pgdir[PDX(va)] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+	if ((pp = vm_pool_pop(&vp->vp_ptabs, &vp->vp_nptabs)))
+		vp->vp_ptab_hits++;
+	else {
+		vp->vp_ptab_misses++;
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
 	}
 
-	// Get PFA from the 32-bit PD entry,
-	// (which points to the start of the
-	// desired page table that we may have
-	// just allocated), convert to kernel
-	// virtual address, and add the offset
-	// that will give us an address that points
-	// to the right entry in said page table.
-	pte_t *pt = KADDR(PTE_ADDR(pde));
-	return &pt[PTX(va)];
+	// (pp_nptes shares its space with the free lists' pp_pprev)
+	pp->pp_nptes = 0;
+	return pp;
 }
 
 //
-// Map [va, va+size) of virtual address space to physical [pa, pa+size)
-// in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
-// va and pa are both page-aligned.
-// Use permission bits perm|PTE_P for the entries.
+// Drop a reference to a page table. Only a page table shared since a
+// fork has more than one; the last must go with no entries left.
 //
-// This function is only intended to set up the ``static'' mappings
-// above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+void
+page_table_free(struct PageInfo *pp)
+{
+	struct VmPool *vp = &vm_pool[cpunum()];
+
+	if (--pp->pp_ref > 0)
+		return;
+	pp->pp_nptes = 0;
+	if (vp->vp_nptabs < PTPOOL_HIGH)
+		vm_pool_push(&vp->vp_ptabs, &vp->vp_nptabs, pp);
+	else
+		page_free(pp);
+}
+
+// Work out how many colours the L2 cache has: its size over that of one
+// way. Without CPUID leaf 0x80000006 to say, assume 512KB 8-way.
 static void
-boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+page_color_init(void)
 {
-	pte_t *pte_p;
+	// Ways for each value of the 4-bit associativity field
+	static const int ways[16] = {
+		0, 1, 2, 0, 4, 0, 8, 0, 16, 0, 32, 48, 64, 96, 128, 0
+	};
+	uint32_t eax, ecx;
+	size_t kb = 512;
+	int assoc = 8, n;
+
+	cpuid(0x80000000, &eax, NULL, NULL, NULL);
+	if (eax >= 0x80000006) {
+		cpuid(0x80000006, NULL, NULL, &ecx, NULL);
+		kb = ecx >> 16;
+		assoc = ways[(ecx >> 12) & 0xF];
+	}
 
-	while (size) {
-		// Get pointer to 2nd-level PTE, allocating
-		// if necessary.
-		pte_p = pgdir_walk(pgdir, (void *)va, 1);
+	// Fully associative (or unknown) caches have no colours
+	n = assoc ? kb * 1024 / (assoc * PGSIZE) : 1;
+	for (page_color_order = 0; (2 << page_color_order) <= n &&
+	     (2 << page_color_order) <= PAGE_NCOLORS_MAX; page_color_order++)
+		/* do nothing */;
+	page_ncolors = 1 << page_color_order;
 
-		// pa is already page-aligned,
-		// so lowest 12 bits already 0.
-		*pte_p = pa | perm | PTE_P;
+	page_color_enabled = PAGE_COLOR;
+	cprintf("page colouring %s: %uKB L2, %d-way, %d colours\n",
+		page_color_enabled ? "on" : "off", kb, assoc, page_ncolors);
+}
+
+static int
+page_color(struct PageInfo *pp)
+{
+	return (pp - pages) & (page_ncolors - 1);
+}
+
+// Take a page of the given colour from zone's bin, refilling the bin
+// (and every other bin) from the buddy allocator if it's empty.
+static struct PageInfo *
+color_bin_alloc(int zone, int color)
+{
+	struct ColorBin *cb = &color_bins[zone][color];
+	struct PageInfo *pp;
+	int i;
 
-		va += PGSIZE, pa += PGSIZE;
-		size -= PGSIZE;
+	if (!cb->cb_list) {
+		if (!(pp = buddy_alloc(page_color_order, zone)))
+			return NULL;
+		for (i = 0; i < page_ncolors; i++) {
+			pp[i].pp_order = 0;
+			pp[i].pp_flags |= PP_COLOR;
+			pp[i].pp_link = color_bins[zone][i].cb_list;
+			color_bins[zone][i].cb_list = &pp[i];
+			color_bins[zone][i].cb_count++;
+		}
+		color_nbinned += page_ncolors;
 	}
+
+	pp = cb->cb_list;
+	cb->cb_list = pp->pp_link;
+	cb->cb_count--;
+	color_nbinned--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_COLOR;
+	return pp;
+}
+
+// Bin a freed page by colour, unless its bin is full.
+static bool
+color_bin_free(struct PageInfo *pp)
+{
+	struct ColorBin *cb = &color_bins[page_zone(pp)][page_color(pp)];
+
+	if (cb->cb_count >= COLOR_BIN_MAX)
+		return false;
+	pp->pp_flags |= PP_COLOR;
+	pp->pp_link = cb->cb_list;
+	cb->cb_list = pp;
+	cb->cb_count++;
+	color_nbinned++;
+	return true;
+}
+
+// Give every binned page back to the buddy allocator.
+static void
+color_bins_drain(void)
+{
+	struct ColorBin *cb;
+	struct PageInfo *pp;
+	int z, c;
+
+	for (z = 0; z < NZONES; z++)
+		for (c = 0; c < PAGE_NCOLORS_MAX; c++) {
+			cb = &color_bins[z][c];
+			while ((pp = cb->cb_list)) {
+				cb->cb_list = pp->pp_link;
+				cb->cb_count--;
+				color_nbinned--;
+				pp->pp_link = NULL;
+				pp->pp_flags &= ~PP_COLOR;
+				buddy_free(pp, 0);
+			}
+		}
 }
 
 //
-// Map the physical page 'pp' at virtual address 'va'.
-// The permissions (the low 12 bits) of the page table entry
-// should be set to 'perm|PTE_P'.
+// Turn page colouring on or off. Turning it off gives the binned pages
+// back.
 //
-// Requirements
-//   - If there is already a page mapped at 'va', it should be page_remove()d.
-//   - If necessary, on demand, a page table should be allocated and inserted
-//     into 'pgdir'.
-//   - pp->pp_ref should be incremented if the insertion succeeds.
-//   - The TLB must be invalidated if a page was formerly present at 'va'.
+void
+page_color_enable(bool on)
+{
+	page_color_enabled = on;
+	if (!on)
+		color_bins_drain();
+}
+
+// Allocates a block of 2^order physically contiguous pages, aligned to
+// its own size. If (alloc_flags & ALLOC_ZERO), fills the entire block
+// with '\0' bytes. Does NOT increment the reference count of the first
+// page - the caller must do these if necessary (either explicitly or via
+// page_insert). The block is treated as a unit: only the first page's
+// PageInfo counts references, and it must be freed with
+// page_free_order using the same order.
 //
-// Make sure to consider what happens when the same
-// pp is re-inserted at the same virtual address in the same pgdir.
+// Single pages come from this CPU's page cache, once it's enabled, or
+// for ALLOC_ZERO, from the pool of pages zeroed while CPUs were idle.
+//
+// With ALLOC_HIGH, the block comes from high memory if there's any free,
+// to save the memory the kernel can reach for the kernel. The caller
+// must then only touch it through page_kmap, never page2kva.
+//
+// Returns NULL if there is no free block that large.
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	char *kva;
+	int i;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+
+	if (order == 0 && (alloc_flags & ALLOC_ZERO)) {
+		if ((pp = zero_pool_pop())) {
+			zero_pool_served++;
+			return pp;
+		}
+		zero_pool_missed++;
+	}
+
+	if (!(alloc_flags & ALLOC_HIGH) || !(pp = buddy_alloc(order, ZONE_HIGH))) {
+		if (order == 0 && page_cache_enabled)
+			pp = page_cache_alloc();
+		else
+			pp = buddy_alloc(order, ZONE_NORMAL);
+	}
+
+	// So are the colour bins
+	if (!pp && color_nbinned) {
+		color_bins_drain();
+		return page_alloc_order(order, alloc_flags);
+	}
+
+	// The zero pool, and the page directory and page table pools, are
+	// just free memory that's had some work done on it; rather than
+	// fail, give them up.
+	if (!pp && vm_pool_drain())
+		return page_alloc_order(order, alloc_flags);
+
+	// Freed environments' memory the reaper hasn't got to yet is as
+	// good as free, too
+	if (!pp && env_reap_pending()) {
+		env_reap_all();
+		return page_alloc_order(order, alloc_flags);
+	}
+	if (!pp && zero_pool) {
+		if (order == 0)
+			return zero_pool_pop();
+		zero_pool_drain();
+		pp = buddy_alloc(order, ZONE_NORMAL);
+	}
+	if (!pp)
+		return NULL;
+
+	// Zero out block, a page at a time if it's in high memory
+	if ((alloc_flags & ALLOC_ZERO) && page_zone(pp) == ZONE_NORMAL)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	else if (alloc_flags & ALLOC_ZERO)
+		for (i = 0; i < (1 << order); i++) {
+			kva = page_kmap(pp + i);
+			memset(kva, 0, PGSIZE);
+			page_kunmap(kva);
+		}
+
+	return pp;
+}
+
+// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
+// returned physical page with '\0' bytes.  Does NOT increment the reference
+// count of the page - the caller must do these if necessary (either explicitly
+// or via page_insert).
+//
+// The pp_link field of the allocated page is NULL, so page_free can
+// check for double-free bugs.
+//
+// This is the common case, and the fast path: usually it's just a pop
+// off this CPU's page cache.
+//
+// Returns NULL if out of free memory.
+struct PageInfo *
+page_alloc(int alloc_flags)
+{
+	return page_alloc_order(0, alloc_flags);
+}
+
+//
+// Allocate a page to be mapped at 'va' in the address space 'pgdir',
+// like page_alloc. With page colouring on, the page's colour follows
+// from va, so consecutive virtual pages land in different cache sets;
+// the colours are offset by pgdir's frame number so that different
+// address spaces don't all start at the same one.
+//
+struct PageInfo *
+page_alloc_user(pde_t *pgdir, uintptr_t va, int alloc_flags)
+{
+	struct PageInfo *pp = NULL;
+	int color;
+	char *kva;
+
+	if (!page_color_enabled)
+		return page_alloc(alloc_flags);
+
+	color = (PGNUM(va) + PGNUM(PADDR(pgdir))) & (page_ncolors - 1);
+	if (alloc_flags & ALLOC_HIGH)
+		pp = color_bin_alloc(ZONE_HIGH, color);
+	if (!pp)
+		pp = color_bin_alloc(ZONE_NORMAL, color);
+	if (!pp) {
+		color_missed++;
+		return page_alloc(alloc_flags);
+	}
+	color_served++;
+
+	if (alloc_flags & ALLOC_ZERO) {
+		kva = page_kmap(pp);
+		memset(kva, 0, PGSIZE);
+		page_kunmap(kva);
+	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages, allocated with page_alloc_order,
+// to the free lists.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	// A page that's already free, still referenced, or still linked
+	// somewhere is a double free or a refcounting bug.
+	if (pp->pp_ref || pp->pp_link ||
+	    (pp->pp_flags & (PP_FREE|PP_PCP|PP_ZERO|PP_COLOR)))
+		panic("Bad free");
+	if (pp->pp_order != order)
+		panic("Bad free: block is order %d, not %d", pp->pp_order, order);
+
+	// The last mapping of a merged page is gone
+	if (pp->pp_flags & PP_KSM)
+		ksm_page_freed(pp);
+	if (pp->pp_rmap)
+		rmap_page_freed(pp);
+
+	if (order == 0 && page_color_enabled && color_bin_free(pp))
+		return;
+
+	if (order == 0 && page_cache_enabled && page_zone(pp) == ZONE_NORMAL) {
+		page_cache_free(pp);
+		return;
+	}
+
+	free_area[page_zone(pp)][order].fa_nfreed++;
+	buddy_free(pp, order);
+}
+
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp)
+{
+	page_free_order(pp, 0);
+}
+
+// Map physical address 'pa' at the next free page of this CPU's kmap
+// window.
+static void *
+kmap_slot(physaddr_t pa)
+{
+	int *depth = &kmap_depth[cpunum()];
+	int slot = cpunum() * KMAP_NSLOTS + *depth;
+
+	if (!kmap_ptes)
+		panic("page_kmap: called before mem_init set up the windows");
+	if (*depth == KMAP_NSLOTS)
+		panic("page_kmap: out of kmap window");
+	(*depth)++;
+	kmap_ptes[slot] = pa | PTE_W | PTE_P;
+	return (void *) (KMAPBASE + slot * PGSIZE);
+}
+
+//
+// Return a kernel virtual address for physical page 'pp'. Pages under
+// the KERNBASE map are simply there; high memory pages are mapped into
+// this CPU's kmap window, which only has room for KMAP_NSLOTS pages at
+// a time. The kernel lock keeps another environment from running on
+// this CPU (and reusing the window) in the meantime.
+//
+// Undo every page_kmap with page_kunmap, innermost first.
+//
+void *
+page_kmap(struct PageInfo *pp)
+{
+	if (page_zone(pp) == ZONE_NORMAL)
+		return page2kva(pp);
+	return kmap_slot(page2pa(pp));
+}
+
+//
+// Undo page_kmap.
+//
+void
+page_kunmap(void *kva)
+{
+	int *depth = &kmap_depth[cpunum()];
+	int slot = cpunum() * KMAP_NSLOTS + *depth - 1;
+
+	// Nothing to do for the KERNBASE map
+	if ((uintptr_t) kva >= KERNBASE)
+		return;
+	if (*depth == 0 || kva != (void *) (KMAPBASE + slot * PGSIZE))
+		panic("page_kunmap: %08x is not the last page_kmap", kva);
+
+	// This CPU is the only one that ever touches its window, so there's
+	// no need for a shootdown.
+	kmap_ptes[slot] = 0;
+	invlpg(kva);
+	(*depth)--;
+}
+
+//
+// Print the buddy allocator's free lists and per-order statistics.
+//
+void
+print_page_stats(void)
+{
+	struct FreeArea *fa;
+	int k, z;
+
+	for (z = 0; z < NZONES; z++) {
+		if (z == ZONE_HIGH && npages == npages_direct)
+			continue;
+		cprintf("zone %s: %u pages free\n", zone_names[z], zone_nfree[z]);
+		cprintf("order  free blocks  allocs     frees      splits     merges\n");
+		for (k = 0; k <= PAGE_MAX_ORDER; k++) {
+			fa = &free_area[z][k];
+			cprintf("%5d  %11u  %-9u  %-9u  %-9u  %-9u\n", k,
+				fa->fa_nfree, fa->fa_nalloc, fa->fa_nfreed,
+				fa->fa_nsplit, fa->fa_nmerge);
+		}
+	}
+	cprintf("%u of %u pages free\n", page_nfree, npages);
+
+	cprintf("zero pool: %d pages (low %d, high %d), %u served, %u missed\n",
+		zero_pool_count, ZPOOL_LOW, ZPOOL_HIGH,
+		zero_pool_served, zero_pool_missed);
+
+	cprintf("cpu  cached  hits       misses     drains\n");
+	for (k = 0; k < ncpu; k++)
+		cprintf("%3d  %6d  %-9u  %-9u  %-9u\n", k,
+			page_cache[k].pc_count, page_cache[k].pc_hits,
+			page_cache[k].pc_misses, page_cache[k].pc_drains);
+
+	cprintf("page colouring %s: %d colours, %d pages binned, "
+		"%u served, %u missed\n", page_color_enabled ? "on" : "off",
+		page_ncolors, color_nbinned, color_served, color_missed);
+
+	cprintf("zero page: %u mappings, %u broken on write\n",
+		zero_page->pp_ref - 1, zero_page_breaks);
+
+	cprintf("copy-on-write in kernel %s: %u copied, %u reused, "
+		"%u left to the environment\n", page_cow_kernel ? "on" : "off",
+		cow_copies, cow_reuses, cow_upcalls);
+	cprintf("fork: %u pages copied up front (up to %d a fork, "
+		"besides the stack)\n", fork_eager_copies, page_fork_eager);
+	cprintf("page table sharing %s: %u shared, %u copied, %u reclaimed\n",
+		page_fork_share ? "on" : "off", ptab_shares, ptab_copies,
+		ptab_reclaims);
+	cprintf("page tables freed once empty: %u\n", ptab_empty_frees);
+
+	cprintf("cpu  pgdirs  hits       misses     ptabs  hits       misses\n");
+	for (k = 0; k < ncpu; k++)
+		cprintf("%3d  %6d  %-9u  %-9u  %5d  %-9u  %-9u\n", k,
+			vm_pool[k].vp_npgdirs, vm_pool[k].vp_pgdir_hits,
+			vm_pool[k].vp_pgdir_misses, vm_pool[k].vp_nptabs,
+			vm_pool[k].vp_ptab_hits, vm_pool[k].vp_ptab_misses);
+}
+
+//
+// Decrement the reference count on a page,
+// freeing it if there are no more refs.
+//
+void
+page_decref(struct PageInfo* pp)
+{
+	if (--pp->pp_ref == 0)
+		page_free_order(pp, pp->pp_order);
+}
+
+// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
+// a pointer to the page table entry (PTE) for linear address 'va'.
+// This requires walking the two-level page table structure.
+//
+// The relevant page table page might not exist yet.
+// If this is true, and create == false, then pgdir_walk returns NULL.
+// Otherwise, pgdir_walk allocates a new page table page with page_alloc.
+//    - If the allocation fails, pgdir_walk returns NULL.
+//    - Otherwise, the new page's reference count is incremented,
+//			the page is cleared, and pgdir_walk returns a pointer into
+//			the new page table page.
+//
+// The x86 MMU checks permission bits in both the page directory
+// and the page table, so it's safe to leave permissions in the page
+// directory more permissive than strictly necessary.
+//
+// If 'va' is mapped by a 4MB superpage (PTE_PS), there is no page table:
+// the PDE itself is the entry mapping 'va', so pgdir_walk returns a
+// pointer to the PDE. Callers that care must check for PTE_PS.
+//
+// With create, a page table shared since a fork (pde_is_shared) is
+// made pgdir's own first, since the caller is presumably about to
+// change it; if there's no memory for that, pgdir_walk returns NULL.
+// Without create, the entry may be in a shared page table, and must
+// only be read.
+pte_t *
+pgdir_walk(pde_t *pgdir, const void *va, int create)
+{
+	// Get 32-bit page directory entry
+	pde_t pde = pgdir[PDX(va)];
+
+	if ((pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS))
+		return &pgdir[PDX(va)];
+
+	if (create && pde_is_shared(pde)) {
+		if (page_table_unshare(pgdir, (uintptr_t) va) < 0)
+			return NULL;
+		pde = pgdir[PDX(va)];
+	}
+
+	if (!(pde & PTE_P)) {  // Page table doesn't exist
+		if (!create)
+			return NULL;
+
+		// Allocate a page for a new page table
+		struct PageInfo *pp = page_table_alloc();
+		if (!pp)
+			return NULL;  // Page allocation fail
+
+		pp->pp_ref++;
+		if (rmap_add(pp, &pgdir[PDX(va)]) < 0) {
+			page_table_free(pp);
+			return NULL;
+		}
+
+		// Get physical address of page corresponding to newly
+		// freed PageInfo pointer, set some meta bits (according
+		// the PTE format), and save it as a new PDE in the page directory.
+		pde = pgdir[PDX(va)] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+	}
+
+	// Get PFA from the 32-bit PD entry,
+	// (which points to the start of the
+	// desired page table that we may have
+	// just allocated), convert to kernel
+	// virtual address, and add the offset
+	// that will give us an address that points
+	// to the right entry in said page table.
+	pte_t *pt = KADDR(PTE_ADDR(pde));
+	return &pt[PTX(va)];
+}
+
+//
+// Start walking the page table entries for [va, va+len) in 'pgdir'
+// (va is rounded down and len up to whole pages). By default only the
+// entries of present pages are visited; with PTE_RANGE_CREATE, every
+// entry is, and missing page tables are allocated along the way (and
+// shared ones unshared, as by pgdir_walk). Without it, an entry in a
+// page table shared since a fork (pde_is_shared) must only be read.
+//
+// A typical loop looks like
+//
+//	pte_range_begin(&r, pgdir, va, len, 0);
+//	while ((pte = pte_range_next(&r)))
+//		... *pte maps r.pr_va ...
+//	pte_range_end(&r);
+//
+// Like pgdir_walk, a 4MB superpage is visited once, as its PTE_PS page
+// directory entry, with r.pr_va the start of the superpage (which may
+// be below 'va').
+//
+// Nothing else may change pgdir until pte_range_end.
+//
+void
+pte_range_begin(struct PteRange *r, pde_t *pgdir, uintptr_t va, size_t len, int flags)
+{
+	r->pr_pgdir = pgdir;
+	r->pr_flags = flags;
+	r->pr_error = 0;
+	r->pr_next = ROUNDDOWN(va, PGSIZE);
+	r->pr_left = ROUNDUP(va - r->pr_next + len, PGSIZE);
+	r->pr_ninval = 0;
+	r->pr_nput = 0;
+	tlb_batch_begin();
+}
+
+//
+// Return the next page table entry in the range, with r->pr_va set to
+// the address it maps, or NULL at the end of the range. With
+// PTE_RANGE_CREATE, NULL may also mean a page table couldn't be
+// allocated, which pte_range_end reports.
+//
+pte_t *
+pte_range_next(struct PteRange *r)
+{
+	uintptr_t va;
+	size_t step;
+	pde_t *pde;
+	pte_t *pt;
+
+	while (r->pr_left) {
+		va = r->pr_next;
+		pde = &r->pr_pgdir[PDX(va)];
+
+		if ((r->pr_flags & PTE_RANGE_CREATE) &&
+		    (!(*pde & PTE_P) || pde_is_shared(*pde)) &&
+		    !pgdir_walk(r->pr_pgdir, (void *) va, 1)) {
+			r->pr_error = -E_NO_MEM;
+			r->pr_left = 0;
+			return NULL;
+		}
+
+		// No page table to look in: skip the rest of its 4MB
+		if (!(*pde & PTE_P) || (*pde & PTE_PS)) {
+			step = MIN(r->pr_left, PTSIZE - (va & (PTSIZE - 1)));
+			r->pr_next += step;
+			r->pr_left -= step;
+			if (!(*pde & PTE_P))
+				continue;
+			r->pr_va = ROUNDDOWN(va, PTSIZE);
+			return pde;
+		}
+
+		pt = KADDR(PTE_ADDR(*pde));
+		do {
+			va = r->pr_next;
+			r->pr_next += PGSIZE;
+			r->pr_left -= PGSIZE;
+			if ((pt[PTX(va)] & PTE_P) || (r->pr_flags & PTE_RANGE_CREATE)) {
+				r->pr_va = va;
+				return &pt[PTX(va)];
+			}
+		} while (r->pr_left && PTX(r->pr_next) != 0);
+	}
+	return NULL;
+}
+
+// Do the TLB invalidations collected so far, then free the pages that
+// were waiting on them.
+static void
+pte_range_flush(struct PteRange *r)
+{
+	int i;
+
+	if (r->pr_ninval > TLB_FLUSH_THRESHOLD)
+		tlb_flush_pgdir(r->pr_pgdir);
+	else
+		for (i = 0; i < r->pr_ninval; i++)
+			tlb_invalidate(r->pr_pgdir, (void *) r->pr_inval[i]);
+	r->pr_ninval = 0;
+
+	// Wait for the other CPUs too
+	tlb_batch_end();
+	tlb_batch_begin();
+
+	for (i = 0; i < r->pr_nput; i++)
+		page_decref(r->pr_put[i]);
+	r->pr_nput = 0;
+}
+
+//
+// The entry pte_range_next last returned was changed, so the TLB needs
+// to forget it by pte_range_end. Past TLB_FLUSH_THRESHOLD entries,
+// the whole TLB is flushed instead.
+//
+void
+pte_range_invalidate(struct PteRange *r)
+{
+	if (r->pr_ninval < TLB_FLUSH_THRESHOLD)
+		r->pr_inval[r->pr_ninval] = r->pr_va;
+	if (r->pr_ninval <= TLB_FLUSH_THRESHOLD)
+		r->pr_ninval++;
+}
+
+//
+// Unmap the page 'pte' (the entry pte_range_next last returned) maps,
+// like page_remove. The reference it held is dropped once the TLB
+// has been invalidated.
+//
+void
+pte_range_remove(struct PteRange *r, pte_t *pte)
+{
+	physaddr_t pa;
+
+	pa = (*pte & PTE_PS) ? PDE_PS_ADDR(*pte) : PTE_ADDR(*pte);
+	rmap_remove(pa2page(pa), pte);
+	if (!(*pte & PTE_PS))
+		page_table_count(pte, -1);
+	*pte = 0;
+	pte_range_invalidate(r);
+	pte_range_put(r, pa2page(pa));
+}
+
+//
+// Drop a reference to 'pp', which an entry in the range used to map,
+// once the TLB has been invalidated.
+//
+void
+pte_range_put(struct PteRange *r, struct PageInfo *pp)
+{
+	if (r->pr_nput == PTE_RANGE_NPUT)
+		pte_range_flush(r);
+	r->pr_put[r->pr_nput++] = pp;
+}
+
+//
+// Finish walking a range: invalidate whatever TLB entries need it and
+// drop the references pte_range_remove held back.
+// Returns 0, or -E_NO_MEM if PTE_RANGE_CREATE couldn't make a page
+// table, in which case the walk stopped short.
+//
+int
+pte_range_end(struct PteRange *r)
+{
+	pte_range_flush(r);
+	tlb_batch_end();
+	return r->pr_error;
+}
+
+//
+// Map [va, va+size) of virtual address space to physical [pa, pa+size)
+// in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
+// va and pa are both page-aligned.
+// Use permission bits perm|PTE_P for the entries.
+//
+// This function is only intended to set up the ``static'' mappings
+// above UTOP. As such, it should *not* change the pp_ref field on the
+// mapped pages.
+//
+// Those mappings are the same in every environment's address space, so
+// they're all marked PTE_G: once CR4_PGE is on, their TLB entries
+// survive the lcr3 in every context switch.
+static void
+boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	struct PteRange r;
+	pte_t *pte_p;
+
+	// Visit every PTE in the range, allocating page tables as needed.
+	pte_range_begin(&r, pgdir, va, size, PTE_RANGE_CREATE);
+	while ((pte_p = pte_range_next(&r)))
+		// pa is already page-aligned,
+		// so lowest 12 bits already 0.
+		*pte_p = (pa + (r.pr_va - va)) | perm | PTE_P | PTE_G;
+	if (pte_range_end(&r) < 0)
+		panic("boot_map_region: out of memory for page tables");
+}
+
+//
+// Like boot_map_region, but maps with 4MB superpages, straight from the
+// page directory: no page tables are allocated. Size is a multiple of
+// PTSIZE, and va and pa are both PTSIZE-aligned. Needs CR4_PSE, which
+// entry.S turns on. These are global (PTE_G) too.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	assert(va % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+
+	while (size) {
+		pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS | PTE_G;
+
+		va += PTSIZE, pa += PTSIZE;
+		size -= PTSIZE;
+	}
+}
+
+//
+// Map the physical page 'pp' at virtual address 'va'.
+// The permissions (the low 12 bits) of the page table entry
+// should be set to 'perm|PTE_P'.
+//
+// Requirements
+//   - If there is already a page mapped at 'va', it should be page_remove()d.
+//   - If necessary, on demand, a page table should be allocated and inserted
+//     into 'pgdir'.
+//   - pp->pp_ref should be incremented if the insertion succeeds.
+//   - The TLB must be invalidated if a page was formerly present at 'va'.
+//
+// Make sure to consider what happens when the same
+// pp is re-inserted at the same virtual address in the same pgdir.
+//
+// If perm includes PTE_PS, pp must head a block of 2^PAGE_HUGE_ORDER
+// pages from page_alloc_order, and is mapped as one 4MB superpage
+// straight from the page directory; 'va' must be PTSIZE-aligned. A
+// huge page replaces everything mapped in its 4MB, and a 4KB page
+// mapped inside a huge page replaces the whole huge page.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated, or pp's rmap (see
+//     kern/rmap.c) couldn't be grown
+//   -E_INVAL, if pp is the wrong size for perm, or va is misaligned
+int
+page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	struct PageInfo *ptp;
+	pte_t *pte_p;
+	bool new_pt;
+
+	if (perm & PTE_PS)
+		return page_insert_huge(pgdir, pp, va, perm);
+	if (pp->pp_order != 0)
+		return -E_INVAL;
+
+	// Past ZERO_PAGE_MAXREF, another mapping of the zero page gets a
+	// zeroed page of its own instead (see page_insert_zero)
+	if (pp == zero_page && pp->pp_ref >= ZERO_PAGE_MAXREF)
+		return page_insert_zero(pgdir, va, perm);
+
+	// There's no page table under a huge page to put a PTE in
+	if (pgdir[PDX(va)] & PTE_PS)
+		page_remove(pgdir, va);
+
+	// Get pointer to PTE, bail if OOM
+	new_pt = !(pgdir[PDX(va)] & PTE_P);
+	pte_p = pgdir_walk(pgdir, va, 1);
+	if (!pte_p)
+		return -E_NO_MEM;
+	if (rmap_add(pp, pte_p) < 0) {
+		// Don't leave behind an empty page table made just for this
+		if (new_pt) {
+			ptp = pa2page(PTE_ADDR(pgdir[PDX(va)]));
+			rmap_remove(ptp, &pgdir[PDX(va)]);
+			pgdir[PDX(va)] = 0;
+			tlb_invalidate(pgdir, va);
+			page_table_free(ptp);
+		}
+		return -E_NO_MEM;
+	}
+
+	// Incr ref count in advance
+	// so page_remove doesn't free
+	// the page if we're trying to
+	// insert a duplicate mapping.
+	// Likewise count the entry in the
+	// page table, so page_remove doesn't
+	// free that if it was the only one.
+	pp->pp_ref++;
+	page_table_count(pte_p, 1);
+
+	if (*pte_p & PTE_P)
+		// An entry already exists. Zero it
+		// and flush the TLB, even if it's
+		// a duplicate mapping (b/c we still
+		// want to update perms). If it's a
+		// duplicate mapping the page's refcount
+		// will just get decr'd instead of
+		// possibly being freed, because we incr'd it above.
+		page_remove(pgdir, va);
+
+	*pte_p = page2pa(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// Unmap every page in the page table that covers 'va', then free the
+// page table itself. A page table shared with other page directories
+// is just let go of, mappings and all.
+//
+static void
+page_table_remove(pde_t *pgdir, void *va)
+{
+	physaddr_t pa = PTE_ADDR(pgdir[PDX(va)]);
+	struct PteRange r;
+	pte_t *pte_p;
+
+	rmap_remove(pa2page(pa), &pgdir[PDX(va)]);
+	if (pde_is_shared(pgdir[PDX(va)]) && pa2page(pa)->pp_ref > 1) {
+		pgdir[PDX(va)] = 0;
+		tlb_flush_pgdir(pgdir);
+		page_table_free(pa2page(pa));
+		return;
+	}
+
+	pte_range_begin(&r, pgdir, ROUNDDOWN((uintptr_t) va, PTSIZE), PTSIZE, 0);
+	while ((pte_p = pte_range_next(&r)))
+		pte_range_remove(&r, pte_p);
+
+	pgdir[PDX(va)] = 0;
+	tlb_invalidate(pgdir, va);
+	pte_range_end(&r);
+
+	// Only free the page table once no CPU can be walking it
+	page_table_free(pa2page(pa));
+}
+
+//
+// page_insert for a 4MB huge page (perm includes PTE_PS).
+//
+static int
+page_insert_huge(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	if ((uintptr_t) va % PTSIZE != 0 || pp->pp_order != PAGE_HUGE_ORDER)
+		return -E_INVAL;
+	if (rmap_add(pp, pde) < 0)
+		return -E_NO_MEM;
+
+	// Same trick as page_insert: take the reference first, so
+	// re-inserting the same huge page doesn't free it.
+	pp->pp_ref++;
+
+	if (*pde & PTE_PS)
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P)
+		page_table_remove(pgdir, va);
+
+	*pde = page2pa(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// Return the page mapped at virtual address 'va'. Basically
+// just wraps pgdir_walk, returning a PageInfo* instead of a
+// PTE pointer.
+//
+// If pte_store is not zero, then we store in it the address
+// of the pte for this page.  This is used by page_remove and
+// can be used to verify page permissions for syscall arguments,
+// but should not be used by most callers.
+//
+// If va is inside a huge page, this returns the huge page's first
+// PageInfo (the one that counts references for the whole 4MB), and the
+// "pte" is the PTE_PS page directory entry.
+//
+// Return NULL if there is no page mapped at va.
+struct PageInfo *
+page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+	// Get pointer to PTE corresponding with va.
+	// Don't create the page if not found.
+	pte_t *pte_p = pgdir_walk(pgdir, va, 0);
+	if (!pte_p || !(*pte_p & PTE_P))
+		return NULL;
+
+	// Store address of PTE
+	if (pte_store)
+		*pte_store = pte_p;
+
+	if (*pte_p & PTE_PS)
+		return pa2page(PDE_PS_ADDR(*pte_p));
+	return pa2page(PTE_ADDR(*pte_p));
+}
+
+//
+// Unmaps the physical page at virtual address 'va'.
+// If there is no physical page at that address, silently does nothing.
+//
+// Details:
+//   - The ref count on the physical page should decrement.
+//   - The physical page should be freed if the refcount reaches 0.
+//   - The pg table entry corresponding to 'va' should be set to 0.
+//     (if such a PTE exists)
+//   - The TLB must be invalidated if you remove an entry from
+//     the page table.
+//   - If 'va' is inside a huge page, the whole 4MB is unmapped.
+//   - If 'va' is in a page table shared since a fork, pgdir gets its own
+//     copy of the page table first. If there's no memory for that,
+//     the page stays mapped: callers that can report the error should
+//     call page_table_unshare themselves first.
+//   - If that was the last page in its page table, below UTOP in an
+//     environment's page directory, the page table is freed too, so
+//     an environment that maps and unmaps buffers all over its address
+//     space doesn't collect empty page tables until it exits.
+void
+page_remove(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *ptp;
+	pte_t *pte_p;
+	bool huge;
+
+	if (page_table_unshare(pgdir, (uintptr_t) va) < 0)
+		return;
+
+	// Get pointer to PageInfo struct corresponding to va
+	pp = page_lookup(pgdir, va, &pte_p);
+
+	if (pp && (*pte_p & PTE_P)) {
+		huge = *pte_p & PTE_PS;
+		rmap_remove(pp, pte_p);
+		*pte_p = 0x0;     // Zero out PTE
+		page_decref(pp);  // Decrement refcount, potentially freeing the page
+		tlb_invalidate(pgdir, va);
+		if (huge)
+			return;
+
+		// The page table is pgdir's own by now (see above)
+		ptp = pa2page(PTE_ADDR(pgdir[PDX(va)]));
+		if (--ptp->pp_nptes == 0 && pgdir != kern_pgdir &&
+		    (uintptr_t) va < UTOP) {
+			rmap_remove(ptp, &pgdir[PDX(va)]);
+			pgdir[PDX(va)] = 0;
+			tlb_invalidate(pgdir, va);
+			page_table_free(ptp);
+			ptab_empty_frees++;
+		}
+	}
+}
+
+// Is 'pte' a demand-zero mapping, one that's meant to be writable but
+// still maps the shared zero page?
+static bool
+pte_is_zero(pte_t pte)
+{
+	return (pte & (PTE_P | PTE_PS | PTE_COW)) == (PTE_P | PTE_COW) &&
+	       PTE_ADDR(pte) == page2pa(zero_page);
+}
+
+// Does 'pte' map the shared zero page at all, demand-zero or read-only?
+// Anything handing out another such mapping must go through
+// page_insert_zero, which keeps its pp_ref from overflowing.
+static bool
+pte_maps_zero(pte_t pte)
+{
+	return (pte & (PTE_P | PTE_PS)) == PTE_P &&
+	       PTE_ADDR(pte) == page2pa(zero_page);
+}
+
+// The permissions to give page_insert_zero to map the zero page the
+// way 'pte' does: writable if it's demand-zero, read-only if not.
+static int
+pte_zero_perm(pte_t pte)
+{
+	return (pte & PTE_SYSCALL & ~PTE_COW) | ((pte & PTE_COW) ? PTE_W : 0);
+}
+
+//
+// Map demand-zero memory at 'va' in 'pgdir': the shared zero page,
+// copy-on-write if 'perm' has PTE_W. Reads cost nothing; the first write
+// gets the page a frame of its own. If the zero page has about as many
+// mappings as its pp_ref can count, this maps a fresh zeroed page
+// instead.
 //
 // RETURNS:
 //   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
 int
-page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+page_insert_zero(pde_t *pgdir, void *va, int perm)
 {
-	// Get pointer to PTE, bail if OOM
-	pte_t *pte_p = pgdir_walk(pgdir, va, 1);
-	if (!pte_p)
+	struct PageInfo *pp;
+	int r;
+
+	if (zero_page->pp_ref >= ZERO_PAGE_MAXREF) {
+		// (page_insert of the zero page ends up here too, with
+		// PTE_COW for writable)
+		if (perm & PTE_COW)
+			perm = (perm & ~PTE_COW) | PTE_W;
+		if (!(pp = page_alloc_user(pgdir, (uintptr_t) va, ALLOC_ZERO | ALLOC_HIGH)))
+			return -E_NO_MEM;
+		if ((r = page_insert(pgdir, pp, va, perm)) < 0)
+			page_free(pp);
+		return r;
+	}
+
+	if (perm & PTE_W)
+		perm = (perm & ~PTE_W) | PTE_COW;
+	return page_insert(pgdir, zero_page, va, perm);
+}
+
+//
+// If 'va' in 'pgdir' is demand-zero, give it a zeroed page of its own,
+// mapped writable. Anything else is left alone.
+//
+// RETURNS:
+//   0 on success, or if there was nothing to do
+//   -E_NO_MEM, if there's no memory for the page
+//
+int
+page_zero_break(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+	pte_t *pte_p;
+	int perm, r;
+
+	if (!(pte_p = pgdir_walk(pgdir, va, 0)) || !pte_is_zero(*pte_p))
+		return 0;
+
+	// The page table has to be pgdir's own for page_insert not to
+	// fail below. Copying it may already have given the page a frame
+	// of its own (see page_table_unshare).
+	if ((r = page_table_unshare(pgdir, (uintptr_t) va)) < 0)
+		return r;
+	pte_p = pgdir_walk(pgdir, va, 0);
+	if (!pte_is_zero(*pte_p))
+		return 0;
+
+	if (!(pp = page_alloc_user(pgdir, (uintptr_t) va, ALLOC_ZERO | ALLOC_HIGH)))
 		return -E_NO_MEM;
 
-	// Incr ref count in advance
-	// so page_remove doesn't free
-	// the page if we're trying to
-	// insert a duplicate mapping
-	pp->pp_ref++;
+	perm = (*pte_p & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if ((r = page_insert(pgdir, pp, va, perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	zero_page_breaks++;
+	return 0;
+}
 
-	if (*pte_p & PTE_P)
-		// An entry already exists. Zero it
-		// and flush the TLB, even if it's
-		// a duplicate mapping (b/c we still
-		// want to update perms). If it's a
-		// duplicate mapping the page's refcount
-		// will just get decr'd instead of
-		// possibly being freed, because we incr'd it above.
-		page_remove(pgdir, va);
+// Copy the contents of page 'from' to page 'to', either of which may be
+// in high memory.
+static void
+page_copy(struct PageInfo *to, struct PageInfo *from)
+{
+	void *dst = page_kmap(to);
+	void *src = page_kmap(from);
+
+	memcpy(dst, src, PGSIZE);
+	page_kunmap(src);
+	page_kunmap(dst);
+}
+
+//
+// Give the copy-on-write page (or huge page) at 'va' in 'pgdir', mapped
+// by *pte_p, a frame that's writable. If nothing else maps its frame,
+// that's the one; otherwise it's a copy. Merged pages (PP_KSM) are always
+// copied, since ksm.c depends on their contents never changing.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if there's no memory for the copy
+//
+static int
+page_cow_break(pde_t *pgdir, uintptr_t va, pte_t *pte_p)
+{
+	struct PageInfo *pp, *np;
+	bool huge = *pte_p & PTE_PS;
+	int i, perm, r;
+
+	va = huge ? ROUNDDOWN(va, PTSIZE) : ROUNDDOWN(va, PGSIZE);
+	pp = pa2page(huge ? PDE_PS_ADDR(*pte_p) : PTE_ADDR(*pte_p));
+	perm = (*pte_p & (PTE_SYSCALL | PTE_PS) & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1 && !(pp->pp_flags & PP_KSM)) {
+		*pte_p = (*pte_p & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, (void *) va);
+		cow_reuses++;
+		return 0;
+	}
+
+	if (huge)
+		np = page_alloc_order(PAGE_HUGE_ORDER, ALLOC_HIGH);
+	else
+		np = page_alloc_user(pgdir, va, ALLOC_HIGH);
+	if (!np)
+		return -E_NO_MEM;
+	for (i = 0; i < (huge ? NPTENTRIES : 1); i++)
+		page_copy(np + i, pp + i);
+
+	if ((r = page_insert(pgdir, np, (void *) va, perm)) < 0) {
+		page_free_order(np, np->pp_order);
+		return r;
+	}
+	cow_copies++;
+	return 0;
+}
+
+//
+// Try to resolve a page fault at 'va' in 'e' without involving e's own
+// page fault handler: a page of e's binary that hasn't been loaded yet,
+// or of a region it reserved (see env_vm_fault), a write to a page
+// table shared since a fork, a write to a demand-zero page, or a write
+// to a copy-on-write page (unless page_cow_kernel is off).
+//
+// RETURNS:
+//   0 if the fault was resolved, and the faulting access can be retried
+//   -E_FAULT if the fault is e's business
+//   -E_NO_MEM if it was resolvable but there's no memory to do it
+//
+int
+page_fault_resolve(struct Env *e, uintptr_t va, uint32_t err)
+{
+	pte_t *pte_p;
+	int r;
+
+	if (va >= UTOP)
+		return -E_FAULT;
+	if (!(err & FEC_PR))
+		return env_vm_fault(e, va, err);
+	if (!(err & FEC_WR))
+		return -E_FAULT;
+	if (!(pte_p = pgdir_walk(e->env_pgdir, (void *) va, 0)))
+		return -E_FAULT;
+
+	// A page table that's shared is read-only as a whole. Once it's
+	// e's own, a page that was writable in it may be still (if e had
+	// the last reference), or be copy-on-write now.
+	if (pde_is_shared(e->env_pgdir[PDX(va)]) &&
+	    (*pte_p & (PTE_P | PTE_U)) == (PTE_P | PTE_U) &&
+	    (*pte_p & (PTE_W | PTE_COW))) {
+		if ((r = page_table_unshare(e->env_pgdir, va)) < 0)
+			return r;
+		pte_p = pgdir_walk(e->env_pgdir, (void *) va, 0);
+		if (*pte_p & PTE_W)
+			return 0;
+	}
+
+	if (pte_is_zero(*pte_p))
+		return page_zero_break(e->env_pgdir, (void *) va);
+	if ((*pte_p & (PTE_P | PTE_U | PTE_W | PTE_COW)) != (PTE_P | PTE_U | PTE_COW))
+		return -E_FAULT;
+	if (!page_cow_kernel || page_cow_break(e->env_pgdir, va, pte_p) < 0) {
+		cow_upcalls++;
+		return -E_FAULT;
+	}
+	return 0;
+}
+
+// Undo page_table_copy: unmap everything in the page table 'np'.
+static void
+page_table_drop(struct PageInfo *np)
+{
+	pte_t *npt = page2kva(np);
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		if (npt[i] & PTE_P) {
+			pp = pa2page(PTE_ADDR(npt[i]));
+			rmap_remove(pp, &npt[i]);
+			npt[i] = 0;
+			page_decref(pp);
+		}
+	np->pp_nptes = 0;
+}
+
+// Fill the empty page table 'np' with the entries of 'ptp', for
+// page_table_unshare, which describes how. 'va' is in the 4MB they map
+// in 'pgdir'. On failure, np is left empty again.
+static int
+page_table_copy(pde_t *pgdir, uintptr_t va, struct PageInfo *np,
+		struct PageInfo *ptp)
+{
+	pte_t *pt = page2kva(ptp), *npt = page2kva(np);
+	struct PageInfo *pp;
+	int i;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (!(pt[i] & PTE_P))
+			continue;
+		if (pte_maps_zero(pt[i]) && zero_page->pp_ref >= ZERO_PAGE_MAXREF) {
+			if (!(pp = page_alloc_user(pgdir, va + i * PGSIZE,
+						   ALLOC_ZERO | ALLOC_HIGH)))
+				goto nomem;
+			// (A new page's first rmap entry takes no memory)
+			rmap_add(pp, &npt[i]);
+			pp->pp_ref++;
+			npt[i] = page2pa(pp) | pte_zero_perm(pt[i]);
+			np->pp_nptes++;
+			continue;
+		}
+		pp = pa2page(PTE_ADDR(pt[i]));
+		if (rmap_add(pp, &npt[i]) < 0)
+			goto nomem;
+		if (pt[i] & PTE_W)
+			pt[i] = (pt[i] & ~(PTE_W | PTE_D)) | PTE_COW;
+		pp->pp_ref++;
+		npt[i] = pt[i];
+		np->pp_nptes++;
+	}
+	return 0;
+
+nomem:
+	// The entries that became copy-on-write in ptp can stay that way
+	page_table_drop(np);
+	return -E_NO_MEM;
+}
+
+//
+// Give 'pgdir' a page table of its own for 'va', if the one there is
+// shared since a fork (pde_is_shared). If no other page directory uses
+// it any more, pgdir just takes it back; otherwise pgdir gets a copy,
+// each page in it gets another reference, and the writable ones become
+// copy-on-write on both sides. (The others' page directory entries
+// were read-only all along, so none of their TLB entries need to go.)
+// Entries that map the zero page get a zeroed page each instead, once
+// the zero page has ZERO_PAGE_MAXREF references. Either way, the page
+// directory entry is writable again afterwards.
+//
+// RETURNS:
+//   0 on success, or if the page table wasn't shared
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_table_unshare(pde_t *pgdir, uintptr_t va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *ptp, *np = NULL;
+	int r = 0;
+
+	if (!pde_is_shared(*pde))
+		return 0;
+	ptp = pa2page(PTE_ADDR(*pde));
+
+	// Allocating for the copy may reap environments that share the
+	// page table, so hold on to it meanwhile, and see who's left
+	// after. Without the hold, pgdir's page_table_free below could
+	// drop the last reference and send it back to the pool with its
+	// entries still in it, for the next pgdir_walk to hand out as
+	// empty to someone else.
+	if (ptp->pp_ref > 1) {
+		ptp->pp_ref++;
+		if (!(np = page_table_alloc()))
+			r = -E_NO_MEM;
+		else {
+			np->pp_ref++;
+			r = page_table_copy(pgdir, va, np, ptp);
+		}
+
+		// Someone besides pgdir and the hold is still using it.
+		// (np's first rmap entry takes no memory, so adding it can't
+		// reap anyone and change that.)
+		if (r == 0 && ptp->pp_ref > 2) {
+			assert(rmap_add(np, pde) == 0);
+			rmap_remove(ptp, pde);
+			*pde = page2pa(np) | PTE_P | PTE_U | PTE_W;
+			tlb_flush_pgdir(pgdir);
+			ptp->pp_ref--;		// The hold
+			page_table_free(ptp);	// pgdir's own reference
+			ptab_copies++;
+			return 0;
+		}
+		ptp->pp_ref--;
+		if (np) {
+			page_table_drop(np);
+			page_table_free(np);
+		}
+		if (r < 0 && ptp->pp_ref > 1)
+			return r;
+		// Nobody else is using it any more after all
+	}
+
+	*pde = (*pde & ~PTE_COW) | PTE_W;
+	tlb_flush_pgdir(pgdir);
+	ptab_reclaims++;
+	return 0;
+}
+
+// Give 'dst' the user mappings 'src' has in [va, va+len), within one
+// page table (or huge page), entry by entry, for page_fork_range.
+// '*neager' counts the pages copied up front so far.
+static int
+page_fork_ptes(pde_t *dst, pde_t *src, uintptr_t va, size_t len,
+	       uintptr_t stack, int *neager)
+{
+	struct PteRange r;
+	struct PageInfo *np;
+	pte_t *pte_p, *dpte_p;
+	physaddr_t pa;
+	int err;
+
+	// src's entries are about to change
+	if ((err = page_table_unshare(src, va)) < 0)
+		return err;
+
+	pte_range_begin(&r, src, va, len, 0);
+	while ((pte_p = pte_range_next(&r))) {
+		if (!(*pte_p & PTE_U))
+			continue;
+
+		// The zero page has to watch its pp_ref
+		if (pte_maps_zero(*pte_p)) {
+			if ((err = page_insert_zero(dst, (void *) r.pr_va,
+						      pte_zero_perm(*pte_p))) < 0)
+				break;
+			continue;
+		}
+
+		if (!(*pte_p & PTE_PS) &&
+		    !(dpte_p = pgdir_walk(dst, (void *) r.pr_va, 1))) {
+			err = -E_NO_MEM;
+			break;
+		}
+
+		// Copy the pages about to be written now. (If there's no
+		// memory for that, they can be shared like the rest.)
+		if ((*pte_p & (PTE_W | PTE_PS)) == PTE_W && page_fork_eager > 0 &&
+		    (r.pr_va == stack ||
+		     (*neager < page_fork_eager && (*pte_p & PTE_D))) &&
+		    (np = page_alloc_user(dst, r.pr_va, ALLOC_HIGH))) {
+			page_copy(np, pa2page(PTE_ADDR(*pte_p)));
+			rmap_add(np, dpte_p);	// the first entry takes no memory
+			np->pp_ref++;
+			page_table_count(dpte_p, 1);
+			*dpte_p = page2pa(np) | (*pte_p & PTE_SYSCALL);
+			*pte_p &= ~PTE_D;
+			pte_range_invalidate(&r);
+			if (r.pr_va != stack)
+				(*neager)++;
+			fork_eager_copies++;
+			continue;
+		}
+
+		if (*pte_p & (PTE_W | PTE_COW)) {
+			*pte_p = (*pte_p & ~(PTE_W | PTE_D)) | PTE_COW;
+			pte_range_invalidate(&r);
+		}
+
+		if (*pte_p & PTE_PS) {
+			pa = PDE_PS_ADDR(*pte_p);
+			dpte_p = &dst[PDX(r.pr_va)];
+		} else
+			pa = PTE_ADDR(*pte_p);
+		if ((err = rmap_add(pa2page(pa), dpte_p)) < 0)
+			break;
+		if (!(*pte_p & PTE_PS))
+			page_table_count(dpte_p, 1);
+		*dpte_p = pa | (*pte_p & (PTE_SYSCALL | PTE_PS));
+		pa2page(pa)->pp_ref++;
+	}
+	pte_range_end(&r);
+	return err;
+}
+
+//
+// Give 'dst' the user mappings 'src' has in [0, end), the way fork does:
+// pages that are writable or copy-on-write become copy-on-write in both,
+// and read-only ones are simply shared. Huge pages are shared whole.
+// dst must have nothing mapped in the range yet.
+//
+// Most page tables aren't copied at all, but shared with dst (see
+// pde_is_shared), leaving their entries alone, so this costs about the
+// same however much of each page table is in use. The first write to
+// one, on either side, gives that side its own copy of the page table,
+// and then the page its own copy as usual. With page_fork_share off,
+// or for the page table holding 'stack' (src's stack pointer), or the
+// last one if 'end' is part way into it, each entry is done
+// separately instead.
+//
+// Some writable pages in those are about to be written by both sides,
+// and would only take a copy-on-write fault each, so dst gets its own
+// copy of them straight away and src keeps them writable: the page
+// holding 'stack', and up to page_fork_eager pages src has written since
+// it was last forked, going by PTE_D. (Making a page copy-on-write
+// clears its PTE_D, so it's set again only by a write after the fork.)
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if dst's page tables couldn't be allocated, in which case
+//     only some of the range was shared
+//
+int
+page_fork_range(pde_t *dst, pde_t *src, uintptr_t end, uintptr_t stack)
+{
+	uintptr_t va;
+	bool flush = false;
+	int err = 0, neager = 0;
+
+	stack = ROUNDDOWN(stack, PGSIZE);
+	for (va = 0; va < end; va += PTSIZE) {
+		if (!(src[PDX(va)] & PTE_P))
+			continue;
+
+		if (!page_fork_share || (src[PDX(va)] & PTE_PS) ||
+		    end - va < PTSIZE || ROUNDDOWN(stack, PTSIZE) == va) {
+			if ((err = page_fork_ptes(dst, src, va,
+						  MIN(end - va, PTSIZE),
+						  stack, &neager)) < 0)
+				break;
+			continue;
+		}
+
+		// src can't be allowed to write through it any more
+		// either, which takes a TLB flush, once for them all
+		if ((err = rmap_add(pa2page(PTE_ADDR(src[PDX(va)])),
+				    &dst[PDX(va)])) < 0)
+			break;
+		if (!pde_is_shared(src[PDX(va)])) {
+			src[PDX(va)] = (src[PDX(va)] & ~PTE_W) | PTE_COW;
+			flush = true;
+		}
+		dst[PDX(va)] = src[PDX(va)];
+		pa2page(PTE_ADDR(src[PDX(va)]))->pp_ref++;
+		ptab_shares++;
+	}
+	if (flush)
+		tlb_flush_pgdir(src);
+	return err;
+}
+
+// Queue 'va' to be invalidated by the CPU owning 'tq', or fall back to
+// a full flush if the queue is full or 'all' is set.
+static void
+tlb_queue_push(struct TlbQueue *tq, uintptr_t va, bool all)
+{
+	spin_lock(&tq->tq_lock);
+	if (!all && tq->tq_nva < TLB_FLUSH_THRESHOLD)
+		tq->tq_va[tq->tq_nva++] = va;
+	else if (!tq->tq_flush_all) {
+		tq->tq_flush_all = true;
+		tlb_stats.ts_full_flushes++;
+	}
+	tq->tq_seq++;
+	spin_unlock(&tq->tq_lock);
+}
+
+// Make sure every CPU we've queued invalidations for has done them.
+// CPUs in user mode are interrupted and waited for; the others will
+// get to them on their own before they next touch user memory.
+static void
+tlb_shootdown(void)
+{
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
+	uint32_t targets = tq->tq_targets;
+	uint32_t waiting = 0, seq[NCPU];
+	uint64_t start, cycles;
+	int i;
+
+	if (!targets)
+		return;
+	tq->tq_targets = 0;
+
+	start = read_tsc();
+	for (i = 0; i < ncpu; i++) {
+		if (!(targets & (1 << i)))
+			continue;
+		// The lock orders our queue push before this read of
+		// tq_in_user; see tlb_enter_user.
+		spin_lock(&tlb_queue[i].tq_lock);
+		seq[i] = tlb_queue[i].tq_seq;
+		spin_unlock(&tlb_queue[i].tq_lock);
+		if (tlb_queue[i].tq_in_user) {
+			lapic_ipi_dest(cpus[i].cpu_id, T_TLBSHOOT);
+			tlb_stats.ts_ipis++;
+			waiting |= 1 << i;
+		}
+	}
+
+	for (i = 0; i < ncpu; i++)
+		if (waiting & (1 << i))
+			while ((int32_t) (tlb_queue[i].tq_done - seq[i]) < 0)
+				asm volatile("pause");
+
+	cycles = read_tsc() - start;
+	tlb_stats.ts_shootdowns++;
+	tlb_stats.ts_cycles += cycles;
+	if (cycles > tlb_stats.ts_max_cycles)
+		tlb_stats.ts_max_cycles = cycles;
+}
+
+// Queue an invalidation of 'va' (or of everything, if 'all') for the
+// other CPUs that might have it cached, and unless we're batching,
+// shoot them down right away.
+static void
+tlb_queue_remote(pde_t *pgdir, uintptr_t va, bool all)
+{
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		// The kernel's own mappings are in every address space;
+		// the rest only matter to CPUs running on this pgdir.
+		if (&cpus[i] == thiscpu || cpus[i].cpu_status == CPU_UNUSED)
+			continue;
+		if ((all || va < UTOP) &&
+		    (!cpus[i].cpu_env || cpus[i].cpu_env->env_pgdir != pgdir))
+			continue;
+		tlb_queue_push(&tlb_queue[i], va, all);
+		tq->tq_targets |= 1 << i;
+	}
+
+	if (!tq->tq_batch)
+		tlb_shootdown();
+}
+
+//
+// Invalidate a TLB entry, but only if the page tables being
+// edited are the ones currently in use by the processor.
+//
+// Other CPUs using the same page tables are sent a shootdown: the
+// address is queued for them, and they're interrupted to flush it.
+// Between tlb_batch_begin and tlb_batch_end, the interrupts are held
+// back and sent all at once by tlb_batch_end.
+//
+void
+tlb_invalidate(pde_t *pgdir, void *va)
+{
+	// Flush the entry only if we're modifying the current address space.
+	if (!curenv || curenv->env_pgdir == pgdir)
+		invlpg(va);
+
+	tlb_queue_remote(pgdir, (uintptr_t) va, false);
+}
+
+//
+// Invalidate every (user) TLB entry for 'pgdir', on every CPU using it.
+// For when there are too many pages to invalidate one at a time.
+//
+void
+tlb_flush_pgdir(pde_t *pgdir)
+{
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(rcr3());
+
+	tlb_queue_remote(pgdir, 0, true);
+}
+
+//
+// Hold back shootdowns from tlb_invalidate until tlb_batch_end, so
+// invalidating many pages costs each target CPU one interrupt instead
+// of one per page. Batches nest.
+//
+void
+tlb_batch_begin(void)
+{
+	tlb_queue[cpunum()].tq_batch++;
+}
 
-	*pte_p = page2pa(pp) | perm | PTE_P;
-	return 0;
+void
+tlb_batch_end(void)
+{
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
+
+	assert(tq->tq_batch > 0);
+	if (--tq->tq_batch == 0)
+		tlb_shootdown();
 }
 
 //
-// Return the page mapped at virtual address 'va'. Basically
-// just wraps pgdir_walk, returning a PageInfo* instead of a
-// PTE pointer.
+// Do the invalidations other CPUs have queued for this one.
+// Called on every way into the kernel and before every return to user
+// mode, as well as from the T_TLBSHOOT interrupt itself.
 //
-// If pte_store is not zero, then we store in it the address
-// of the pte for this page.  This is used by page_remove and
-// can be used to verify page permissions for syscall arguments,
-// but should not be used by most callers.
+void
+tlb_shootdown_drain(void)
+{
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
+	int i;
+
+	spin_lock(&tq->tq_lock);
+	if (tq->tq_flush_all) {
+		// Toggling PGE flushes everything, global entries included
+		lcr4(rcr4() & ~CR4_PGE);
+		lcr4(rcr4() | CR4_PGE);
+	} else
+		for (i = 0; i < tq->tq_nva; i++)
+			invlpg((void *) tq->tq_va[i]);
+	tq->tq_nva = 0;
+	tq->tq_flush_all = false;
+	tq->tq_done = tq->tq_seq;
+	spin_unlock(&tq->tq_lock);
+}
+
 //
-// Return NULL if there is no page mapped at va.
-struct PageInfo *
-page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+// This CPU is about to drop into user mode (with interrupts on, so it
+// can take shootdown interrupts), or has just trapped out of it. While
+// it's in the kernel, it doesn't get interrupted for shootdowns; other
+// CPUs leave them queued and it drains them itself.
+//
+void
+tlb_enter_user(void)
 {
-	// Get pointer to PTE corresponding with va.
-	// Don't create the page if not found.
-	pte_t *pte_p = pgdir_walk(pgdir, va, 0);
-	if (!pte_p || !(*pte_p & PTE_P))
-		return NULL;
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
 
-	// Store address of PTE
-	if (pte_store)
-		*pte_store = pte_p;
+	// Mark ourselves first, then drain: a CPU that queued work
+	// before seeing the mark is drained here, one that queued it
+	// after will interrupt us for it.
+	xchg(&tq->tq_in_user, 1);
+	tlb_shootdown_drain();
+}
 
-	return pa2page(PTE_ADDR(*pte_p));
+void
+tlb_leave_user(void)
+{
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
+
+	// Drain before we might spin on the kernel lock: whoever holds
+	// it may be waiting for us to do this.
+	xchg(&tq->tq_in_user, 0);
+	tlb_shootdown_drain();
 }
 
 //
-// Unmaps the physical page at virtual address 'va'.
-// If there is no physical page at that address, silently does nothing.
+// Take a T_TLBSHOOT the way a CPU halted in sched_halt would, with no
+// environment running, and check that it does what's queued for it.
+// Needs the IDT, so i386_init calls this once trap_init is done.
 //
-// Details:
-//   - The ref count on the physical page should decrement.
-//   - The physical page should be freed if the refcount reaches 0.
-//   - The pg table entry corresponding to 'va' should be set to 0.
-//     (if such a PTE exists)
-//   - The TLB must be invalidated if you remove an entry from
-//     the page table.
 void
-page_remove(pde_t *pgdir, void *va)
+check_tlb_shootdown(void)
 {
-	struct PageInfo *pp;
-	pte_t *pte_p;
+	struct TlbQueue *tq = &tlb_queue[cpunum()];
 
-	// Get pointer to PageInfo struct corresponding to va
-	pp = page_lookup(pgdir, va, &pte_p);
+	assert(!curenv);
+	tlb_queue_push(tq, KERNBASE, false);
+	assert(tq->tq_done != tq->tq_seq && tq->tq_nva == 1);
+	asm volatile("int %0" : : "i" (T_TLBSHOOT) : "memory");
+	assert(tq->tq_done == tq->tq_seq && tq->tq_nva == 0);
 
-	if (pp && (*pte_p & PTE_P)) {
-		*pte_p = 0x0;     // Zero out PTE
-		page_decref(pp);  // Decrement refcount, potentially freeing the page
-		tlb_invalidate(pgdir, va);
-	}
+	cprintf("check_tlb_shootdown() succeeded!\n");
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Print TLB shootdown statistics.
 //
 void
-tlb_invalidate(pde_t *pgdir, void *va)
+print_tlb_stats(void)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	cprintf("shootdowns: %u, IPIs sent: %u, full flushes: %u\n",
+		tlb_stats.ts_shootdowns, tlb_stats.ts_ipis,
+		tlb_stats.ts_full_flushes);
+	if (tlb_stats.ts_shootdowns)
+		cprintf("latency: %llu cycles average, %llu max\n",
+			tlb_stats.ts_cycles / tlb_stats.ts_shootdowns,
+			tlb_stats.ts_max_cycles);
 }
 
 //
@@ -693,25 +2823,41 @@ static uint32_t user_mem_check_len;
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
+	uintptr_t start = (uintptr_t) va, end, next;
+	struct PteRange r;
 	pte_t *pte_p;
-	uintptr_t start, end;
-
-	start = (uintptr_t)ROUNDDOWN(va, PGSIZE);
-	end = (uintptr_t)va + len;
-
-	while (start <= end) {
-		pte_p = pgdir_walk(env->env_pgdir, (void *)start, 0);
 
-		if ((start > ULIM) || !pte_p || !(*pte_p & (perm | PTE_P))) {
-			// buggyhello2 test expects different
-			// output here but I think this is
-			// more useful.
-			user_mem_check_addr = (uintptr_t)va;
-			user_mem_check_len = len;
-			return -E_FAULT;
-		}
+	// An empty range still has to start somewhere valid
+	end = start + MAX(len, (size_t) 1);
+	perm |= PTE_P;
+
+	if (end < start || end > ULIM)
+		next = MAX(start, ULIM);
+	else {
+		// Walk the present pages in the range, after loading any
+		// part of the binary that isn't yet; it's good up to the
+		// first hole or page without the right permissions.
+		env_vm_populate(env, start, end);
+		next = ROUNDDOWN(start, PGSIZE);
+		pte_range_begin(&r, env->env_pgdir, start, end - start, 0);
+		// Demand-zero pages count as writable: the kernel's first
+		// write to one gives it a page of its own. So do
+		// copy-on-write pages, if the kernel breaks those itself.
+		while ((pte_p = pte_range_next(&r)) && r.pr_va <= next &&
+		       ((*pte_p | (pte_is_zero(*pte_p) ||
+				   (page_cow_kernel && (*pte_p & PTE_COW)) ?
+				   PTE_W : 0)) & perm) == perm)
+			next = r.pr_va + ((*pte_p & PTE_PS) ? PTSIZE : PGSIZE);
+		pte_range_end(&r);
+	}
 
-		start += PGSIZE;
+	if (next < end) {
+		// buggyhello2 test expects different
+		// output here but I think this is
+		// more useful.
+		user_mem_check_addr = MAX(start, next);
+		user_mem_check_len = len;
+		return -E_FAULT;
 	}
 	return 0;
 }
@@ -726,13 +2872,108 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
-		// buggyhello2 test expects a different output here but I
-		// think this is more useful
-		cprintf("[%08x] user_mem_check assertion failure for "
-			"va %08x, len %d\n", env->env_id, user_mem_check_addr, user_mem_check_len);
-		env_destroy(env);	// may not return
-	}
+	if (user_mem_check(env, va, len, perm | PTE_U) < 0)
+		user_mem_fault(env);	// may not return
+}
+
+//
+// Report that 'env' handed the kernel a bad pointer, at the address
+// user_mem_check or copyin & co. last failed on, and destroy it.
+// If env is the current environment, this does not return.
+//
+void
+user_mem_fault(struct Env *env)
+{
+	// buggyhello2 test expects a different output here but I
+	// think this is more useful
+	cprintf("[%08x] user_mem_check assertion failure for "
+		"va %08x, len %d\n", env->env_id, user_mem_check_addr, user_mem_check_len);
+	env_destroy(env);	// may not return
+}
+
+// In usercopy.S
+size_t copy_user(void *dst, const void *src, size_t len);
+int copy_user_str(char *dst, const char *src, size_t max);
+
+// Set up user_mem_check_addr & co. for a failed copy of 'len' bytes,
+// starting at 'va', and return -E_FAULT.
+static int
+copy_fault(uintptr_t va, size_t len)
+{
+	user_mem_check_addr = va;
+	user_mem_check_len = len;
+	return -E_FAULT;
+}
+
+//
+// Copy 'len' bytes from user address 'usrc' in the current address
+// space to 'dst' in the kernel. Rather than check every page first,
+// like user_mem_check, this just goes ahead and lets the copy fault if
+// the user memory isn't there: so it's a single pass over the buffer.
+//
+// Returns 0 on success, -E_FAULT (with user_mem_check_addr set to the
+// first bad address, for user_mem_fault) if any of the user memory is
+// missing or not the user's to read.
+//
+int
+copyin(void *dst, const void *usrc, size_t len)
+{
+	uintptr_t va = (uintptr_t) usrc;
+	size_t left;
+
+	// The fault only catches missing pages: the kernel can read
+	// everything above ULIM, so keep the user out of there.
+	if (va + len < va || va + len > ULIM)
+		return copy_fault(MAX(va, ULIM), len);
+	if ((left = copy_user(dst, usrc, len)))
+		return copy_fault(va + len - left, len);
+	return 0;
+}
+
+//
+// Copy 'len' bytes from 'src' in the kernel to user address 'udst' in
+// the current address space. Like copyin, but the user memory has to be
+// writable too, and below UTOP.
+//
+int
+copyout(void *udst, const void *src, size_t len)
+{
+	uintptr_t va = (uintptr_t) udst;
+	size_t left;
+
+	// With CR0_WP on, the kernel can't write read-only user pages
+	// either, so those fault like missing ones.
+	if (va + len < va || va + len > UTOP)
+		return copy_fault(MAX(va, UTOP), len);
+	if ((left = copy_user(udst, src, len)))
+		return copy_fault(va + len - left, len);
+	return 0;
+}
+
+//
+// Copy the NUL-terminated string at user address 'usrc' into the
+// 'size'-byte kernel buffer 'dst'.
+//
+// Returns the length of the string, -E_INVAL if it doesn't fit in
+// 'size' bytes (NUL included), or -E_FAULT as for copyin.
+//
+int
+copyinstr(char *dst, const char *usrc, size_t size)
+{
+	uintptr_t va = (uintptr_t) usrc;
+	size_t max;
+	int r;
+
+	if (va >= ULIM)
+		return copy_fault(va, size);
+
+	// Don't read past ULIM looking for the NUL
+	max = MIN(size, ULIM - va);
+	if ((r = copy_user_str(dst, usrc, max)) < 0)
+		return copy_fault(rcr2(), size);
+	if ((size_t) r == max)
+		return max < size ? copy_fault(ULIM, size) : -E_INVAL;
+	return r;
 }
 
 
@@ -741,68 +2982,123 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Temporarily steal every free page, so the checks can exercise the
+// allocator running dry. The stolen pages are kept on a stack threaded
+// through pp_link; give them back with check_return_free_pages.
+//
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *stolen = NULL;
+
+	while ((pp = page_alloc(ALLOC_HIGH))) {
+		pp->pp_link = stolen;
+		stolen = pp;
+	}
+	return stolen;
+}
+
+//
+// Give back the pages taken by check_steal_free_pages. They're freed
+// from the top of memory down, like page_init does, so the free lists
+// come back sorted lowest address first: until mem_init loads
+// kern_pgdir, we still depend on page_alloc handing out low pages.
 //
 static void
-check_page_free_list(bool only_low_memory)
+check_return_free_pages(struct PageInfo *stolen)
 {
 	struct PageInfo *pp;
+	size_t i;
+
+	while ((pp = stolen)) {
+		stolen = pp->pp_link;
+		pp->pp_link = NULL;
+		pp->pp_flags |= PP_STOLEN;
+	}
+	for (i = npages; i-- > 0; )
+		if (pages[i].pp_flags & PP_STOLEN) {
+			pages[i].pp_flags &= ~PP_STOLEN;
+			page_free(&pages[i]);
+		}
+}
+
+//
+// Check that the pages on the buddy free lists are reasonable.
+//
+static void
+check_page_free_list(bool only_low_memory)
+{
+	struct PageInfo *pp, *blk;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
+	size_t nfree = 0, nblocks;
 	char *first_free_page;
+	int k, z;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
+	if (!page_nfree)
+		panic("no free pages!");
 
+	// page_init leaves every free list lowest address first, which is
+	// what lets us allocate before entry_pgdir is replaced: it only
+	// maps the first 4MB, so the next page page_alloc hands out, from
+	// the smallest free block, had better be in there.
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		// Points page_free_list to the first element in page_free_list
-		// with a PDX below pdx_limit.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };  // Array of 2 pointers to pointers
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
+		for (k = 0; !free_area[ZONE_NORMAL][k].fa_list; k++)
+			/* do nothing */;
+		assert(PDX(page2pa(free_area[ZONE_NORMAL][k].fa_list)) < pdx_limit);
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	// TODO currently seeing some pages filled with 0x97s. e.g. 0x3fd000,
-	// calculated in the first page2kva call in check_page_alloc. However,
-	// that's in the first call to check_page_free_list(1), so pdx_limit
-	// is 1, so maybe that's expected.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	// (High memory isn't in the KERNBASE map to scribble on.)
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+		for (blk = free_area[ZONE_NORMAL][k].fa_list; blk; blk = blk->pp_link)
+			for (pp = blk; pp < blk + (1 << k); pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (z = 0; z < NZONES; z++) {
+		for (k = 0; k <= PAGE_MAX_ORDER; k++) {
+			nblocks = 0;
+			for (blk = free_area[z][k].fa_list; blk; blk = blk->pp_link) {
+				// check that we didn't corrupt the free list itself
+				assert(blk >= pages);
+				assert(blk + (1 << k) <= pages + npages);
+				assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+				assert(*blk->pp_pprev == blk);
+				// every block is a free head of the right order,
+				// aligned to its own size
+				assert(blk->pp_flags & PP_FREE);
+				assert(blk->pp_order == k);
+				assert((blk - pages) % (1 << k) == 0);
+				assert(page_zone(blk) == z && page_zone(blk + (1 << k) - 1) == z);
+				nblocks++;
+
+				for (pp = blk; pp < blk + (1 << k); pp++) {
+					// check a few pages that shouldn't be on the free list
+					assert(pp->pp_ref == 0);
+					assert(page2pa(pp) != 0);
+					assert(page2pa(pp) != IOPHYSMEM);
+					assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+					assert(page2pa(pp) != EXTPHYSMEM);
+					assert(page2pa(pp) < EXTPHYSMEM || page2pa(pp) >= PADDR(first_free_page));
+					// (new test for lab 4)
+					assert(page2pa(pp) != MPENTRY_PADDR);
+
+					if (page2pa(pp) < EXTPHYSMEM)
+						++nfree_basemem;
+					else
+						++nfree_extmem;
+					++nfree;
+				}
+			}
+			assert(nblocks == free_area[z][k].fa_nfree);
+		}
 	}
 
+	assert(nfree == page_nfree);
+	assert(nfree == zone_nfree[ZONE_NORMAL] + zone_nfree[ZONE_HIGH]);
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
@@ -824,8 +3120,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree;
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -841,11 +3136,11 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
+	assert(page_nfree == 0);
 
 	// free and re-allocate?
 	page_free(pp0);
@@ -870,7 +3165,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -878,9 +3173,38 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == page_nfree);
+
+	// multi-page blocks are aligned to their own size
+	assert((pp0 = page_alloc_order(2, 0)));
+	assert(pp0->pp_order == 2);
+	assert(page2pa(pp0) % (4 * PGSIZE) == 0);
+	assert(page_nfree == nfree - 4);
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// with nothing else free, a freed block is split to serve
+	// single pages, lowest page first...
+	fl = check_steal_free_pages();
+	page_free_order(pp0, 2);
+	assert(page_nfree == 4);
+	for (i = 0; i < 4; i++)
+		assert(page_alloc(0) == pp0 + i);
+	assert(!page_alloc(0));
+
+	// ...and the pages merge back into one block when they're freed,
+	// in any order
+	page_free(pp0 + 2);
+	page_free(pp0);
+	page_free(pp0 + 3);
+	page_free(pp0 + 1);
+	assert(free_area[ZONE_NORMAL][2].fa_list == pp0);
+	assert(free_area[ZONE_NORMAL][2].fa_nfree == 1);
+	assert(page_alloc_order(2, 0) == pp0);
+	assert(page_nfree == 0);
+	page_free_order(pp0, 2);
+
+	check_return_free_pages(fl);
+	assert(nfree == page_nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -906,13 +3230,16 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
+	// check envs array (new test for lab 3): its page table is there,
+	// and whatever env_init has added to it so far is mapped
+	assert(pgdir[PDX(UENVS)] & PTE_P);
+	n = nenvs * sizeof(struct Env);
 	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+		assert(check_va2pa(pgdir, UENVS + i) ==
+		       PADDR(env_chunks[i / PGSIZE]));
 
-	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	// check phys mem (the part of it the KERNBASE map covers)
+	for (i = 0; i < npages_direct * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
@@ -928,6 +3255,13 @@ check_kern_pgdir(void)
 			assert(check_va2pa(pgdir, base + i) == ~0);
 	}
 
+	// the kernel's mappings are global, except UVPT, which maps
+	// whichever page directory is loaded
+	assert(pgdir[PDX(KERNBASE)] & PTE_G);
+	assert(*pgdir_walk(pgdir, (void *) UPAGES, 0) & PTE_G);
+	assert(*pgdir_walk(pgdir, (void *) (KSTACKTOP - KSTKSIZE), 0) & PTE_G);
+	assert(!(pgdir[PDX(UVPT)] & PTE_G));
+
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
 		switch (i) {
@@ -942,6 +3276,8 @@ check_kern_pgdir(void)
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
+				// direct map is all superpages
+				assert(pgdir[i] & PTE_PS);
 			} else
 				assert(pgdir[i] == 0);
 			break;
@@ -965,6 +3301,10 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	if (!(*pgdir & PTE_P))  // PDE not present
 		return ~0;
 
+	// 4MB superpage: the PDE maps va directly
+	if (*pgdir & PTE_PS)
+		return PDE_PS_ADDR(*pgdir) + PTX(va) * PGSIZE;
+
 	// Get pointer to PT from PDE
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 
@@ -998,8 +3338,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1119,7 +3458,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1152,6 +3491,71 @@ check_page(void)
 	cprintf("check_page() succeeded!\n");
 }
 
+//
+// Check the page table range walker.
+//
+static void
+check_pte_range(void)
+{
+	uintptr_t va[3] = { PTSIZE - PGSIZE, 3 * PTSIZE, 3 * PTSIZE + 2 * PGSIZE };
+	struct PageInfo *pp[3];
+	struct PteRange r;
+	size_t nfree = page_nfree;
+	pte_t *pte;
+	int i, n;
+
+	for (i = 0; i < 3; i++) {
+		assert((pp[i] = page_alloc(0)));
+		assert(page_insert(kern_pgdir, pp[i], (void *) va[i], PTE_W) == 0);
+	}
+
+	// only present entries are visited, in order, skipping over
+	// the page tables that aren't there
+	pte_range_begin(&r, kern_pgdir, 0, 4 * PTSIZE, 0);
+	for (n = 0; (pte = pte_range_next(&r)); n++) {
+		assert(n < 3 && r.pr_va == va[n]);
+		assert(PTE_ADDR(*pte) == page2pa(pp[n]));
+	}
+	assert(n == 3 && pte_range_end(&r) == 0);
+
+	// an unaligned range covers every page it touches
+	pte_range_begin(&r, kern_pgdir, 3 * PTSIZE + PGSIZE + 1, PGSIZE, 0);
+	assert(pte_range_next(&r) && r.pr_va == va[2]);
+	assert(!pte_range_next(&r));
+	pte_range_end(&r);
+
+	// PTE_RANGE_CREATE visits every entry, present or not
+	pte_range_begin(&r, kern_pgdir, 3 * PTSIZE, 4 * PGSIZE, PTE_RANGE_CREATE);
+	for (n = 0; (pte = pte_range_next(&r)); n++) {
+		assert(r.pr_va == 3 * PTSIZE + n * PGSIZE);
+		assert(!!(*pte & PTE_P) == (n == 0 || n == 2));
+	}
+	assert(n == 4 && pte_range_end(&r) == 0);
+
+	// removed pages are unmapped right away, but only let go of once
+	// the walk is over
+	pte_range_begin(&r, kern_pgdir, 0, 4 * PTSIZE, 0);
+	while ((pte = pte_range_next(&r)))
+		pte_range_remove(&r, pte);
+	for (i = 0; i < 3; i++) {
+		assert(check_va2pa(kern_pgdir, va[i]) == ~0);
+		assert(pp[i]->pp_ref == 1);
+	}
+	pte_range_end(&r);
+	for (i = 0; i < 3; i++)
+		assert(pp[i]->pp_ref == 0);
+
+	// free the page tables
+	for (i = 0; i < 4; i++)
+		if (kern_pgdir[i] & PTE_P) {
+			page_decref(pa2page(PTE_ADDR(kern_pgdir[i])));
+			kern_pgdir[i] = 0;
+		}
+	assert(page_nfree == nfree);
+
+	cprintf("check_pte_range() succeeded!\n");
+}
+
 // check page_insert, page_remove, &c, with an installed kern_pgdir
 static void
 check_page_installed_pgdir(void)
@@ -1193,3 +3597,519 @@ check_page_installed_pgdir(void)
 
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
+
+//
+// Check the per-CPU page caches in front of the buddy allocator.
+//
+static void
+check_page_cache(void)
+{
+	struct PageCache *pc = &page_cache[cpunum()];
+	struct PageInfo *pp, *pp0, *taken = NULL;
+	size_t nfree = page_nfree + pc->pc_count;
+	uint32_t hits, misses, drains;
+	int i;
+
+	// an empty cache is refilled with a whole batch
+	page_cache_drain(pc, pc->pc_count);
+	misses = pc->pc_misses;
+	assert((pp0 = page_alloc(0)));
+	assert(!(pp0->pp_flags & (PP_FREE|PP_PCP)) && !pp0->pp_link);
+	assert(pc->pc_misses == misses + 1);
+	assert(pc->pc_count == PCP_BATCH - 1);
+	assert(page_nfree == nfree - PCP_BATCH);
+
+	// a freed page is the next one handed out again
+	hits = pc->pc_hits;
+	page_free(pp0);
+	assert(pp0->pp_flags & PP_PCP);
+	assert(page_alloc(0) == pp0);
+	assert(pc->pc_hits == hits + 1);
+
+	// the cache gives a batch back once it holds too many
+	drains = pc->pc_drains;
+	for (i = 0; i < PCP_HIGH; i++) {
+		assert((pp = page_alloc(0)));
+		pp->pp_link = taken;
+		taken = pp;
+	}
+	page_free(pp0);
+	while ((pp = taken)) {
+		taken = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	assert(pc->pc_drains == drains + 1);
+	assert(pc->pc_count <= PCP_HIGH);
+
+	// and nothing got lost along the way
+	assert(page_nfree + pc->pc_count == nfree);
+
+	cprintf("check_page_cache() succeeded!\n");
+}
+
+//
+// Check the pool of pre-zeroed pages.
+//
+static void
+check_zero_pool(void)
+{
+	struct PageInfo *pp, *pp0;
+	uint32_t served, missed;
+	char *c;
+	int i;
+
+	assert(zero_pool_count == 0);
+
+	// an idle CPU fills the pool a batch at a time
+	page_zero_pool_fill();
+	assert(zero_pool_count == ZPOOL_BATCH);
+	assert(zero_pool_filling);
+	for (pp = zero_pool; pp; pp = pp->pp_link) {
+		assert(pp->pp_flags & PP_ZERO);
+		c = page2kva(pp);
+		for (i = 0; i < PGSIZE; i++)
+			assert(c[i] == 0);
+	}
+
+	// ALLOC_ZERO takes a pooled page; nothing else does
+	pp0 = zero_pool;
+	served = zero_pool_served;
+	assert((pp = page_alloc(ALLOC_ZERO)) == pp0);
+	assert(!(pp->pp_flags & PP_ZERO) && !pp->pp_link);
+	assert(zero_pool_served == served + 1);
+	assert(zero_pool_count == ZPOOL_BATCH - 1);
+	assert((pp0 = page_alloc(0)) && pp0 != zero_pool);
+	assert(zero_pool_count == ZPOOL_BATCH - 1);
+	page_free(pp0);
+
+	// with the pool empty, ALLOC_ZERO falls back to zeroing inline
+	zero_pool_drain();
+	memset(page2kva(pp), 1, PGSIZE);
+	page_free(pp);
+	missed = zero_pool_missed;
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	assert(zero_pool_missed == missed + 1);
+	c = page2kva(pp);
+	for (i = 0; i < PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free(pp);
+	zero_pool_filling = false;
+
+	cprintf("check_zero_pool() succeeded!\n");
+}
+
+//
+// Check the page directory and page table pools.
+//
+static void
+check_vm_pool(void)
+{
+	struct VmPool *vp = &vm_pool[cpunum()];
+	struct PageInfo *pp, *pp0, *pt;
+	pde_t *pgdir;
+	pte_t *pte;
+	int i;
+
+	// (the checks before this one already made page tables)
+	memset(vp, 0, sizeof(*vp));
+
+	// a new page directory has the kernel half, an empty user half,
+	// and itself at UVPT
+	assert((pp0 = pgdir_alloc()) && pp0->pp_ref == 1);
+	assert(vp->vp_pgdir_misses == 1);
+	pgdir = page2kva(pp0);
+	for (i = 0; i < NPDENTRIES; i++)
+		if (i == PDX(UVPT))
+			assert(pgdir[i] == (page2pa(pp0) | PTE_P | PTE_U));
+		else if (i < PDX(UTOP))
+			assert(pgdir[i] == 0);
+		else
+			assert(pgdir[i] == kern_pgdir[i]);
+
+	// page tables come zeroed, and are pooled once empty
+	assert((pte = pgdir_walk(pgdir, (void *) PGSIZE, 1)));
+	assert(vp->vp_ptab_misses == 1);
+	pt = pa2page(PTE_ADDR(pgdir[0]));
+	assert(pt->pp_ref == 1);
+	for (i = 0; i < NPTENTRIES; i++)
+		assert(((pte_t *) page2kva(pt))[i] == 0);
+	pgdir[0] = 0;
+	page_table_free(pt);
+	assert(vp->vp_nptabs == 1 && (pt->pp_flags & PP_VMPOOL));
+	assert(pgdir_walk(pgdir, (void *) PGSIZE, 1));
+	assert(pa2page(PTE_ADDR(pgdir[0])) == pt && vp->vp_ptab_hits == 1);
+	assert(!(pt->pp_flags & PP_VMPOOL) && vp->vp_nptabs == 0);
+	pgdir[0] = 0;
+	page_table_free(pt);
+
+	// a freed page directory is handed out again as it is
+	pgdir_free(pp0);
+	assert(vp->vp_npgdirs == 1 && (pp0->pp_flags & PP_VMPOOL));
+	assert((pp = pgdir_alloc()) == pp0 && vp->vp_pgdir_hits == 1);
+	assert(pgdir[PDX(UVPT)] == (page2pa(pp0) | PTE_P | PTE_U));
+	pgdir_free(pp);
+
+	// an idle CPU fills its pool
+	pgdir_pool_fill();
+	assert(vp->vp_npgdirs == PDPOOL_HIGH);
+
+	// the pools are given up rather than fail an allocation; they also
+	// mustn't outlive boot, while the kernel's mappings can still change
+	assert(vm_pool_drain() == PDPOOL_HIGH + 1);
+	assert(vp->vp_npgdirs == 0 && vp->vp_nptabs == 0);
+	memset(vp, 0, sizeof(*vp));
+
+	cprintf("check_vm_pool() succeeded!\n");
+}
+
+//
+// Check the per-CPU windows for mapping high memory.
+//
+static void
+check_kmap(void)
+{
+	struct PageInfo *pp;
+	char *kva, *kva2;
+	int i;
+
+	// pages under the KERNBASE map are used from there
+	assert((pp = page_alloc(0)));
+	assert(page_kmap(pp) == page2kva(pp));
+	page_kunmap(page2kva(pp));
+
+	// the window is just another mapping of the same page...
+	memset(page2kva(pp), 1, PGSIZE);
+	kva = kmap_slot(page2pa(pp));
+	assert(kva == (char *) KMAPBASE + cpunum() * KMAP_NSLOTS * PGSIZE);
+	assert(check_va2pa(kern_pgdir, (uintptr_t) kva) == page2pa(pp));
+	assert(kva[0] == 1 && kva[PGSIZE - 1] == 1);
+	kva[0] = 2;
+	assert(*(char *) page2kva(pp) == 2);
+
+	// ...windows nest, and are gone once unmapped
+	kva2 = kmap_slot(page2pa(pp));
+	assert(kva2 == kva + PGSIZE && kva2[0] == 2);
+	page_kunmap(kva2);
+	page_kunmap(kva);
+	assert(check_va2pa(kern_pgdir, (uintptr_t) kva) == ~0);
+	assert(kmap_depth[cpunum()] == 0);
+	page_free(pp);
+
+	// ALLOC_HIGH prefers high memory, and zeroes it through the window
+	if (zone_nfree[ZONE_HIGH]) {
+		assert((pp = page_alloc(ALLOC_HIGH | ALLOC_ZERO)));
+		assert(page_zone(pp) == ZONE_HIGH);
+		kva = page_kmap(pp);
+		assert(kva < (char *) KERNBASE);
+		for (i = 0; i < PGSIZE; i++)
+			assert(kva[i] == 0);
+		page_kunmap(kva);
+		page_free(pp);
+	}
+
+	cprintf("check_kmap() succeeded!\n");
+}
+
+//
+// Check demand-zero mappings of the shared zero page.
+//
+static void
+check_zero_page(void)
+{
+	struct PageInfo *pp, *cp;
+	struct Env e;
+	pde_t *pgdir, *cpgdir;
+	pte_t *pte;
+	uint32_t breaks = zero_page_breaks;
+	int ref = zero_page->pp_ref;
+	char *kva;
+	int i;
+
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	pp->pp_ref++;
+	pgdir = page2kva(pp);
+
+	// writable demand-zero memory maps the zero page copy-on-write...
+	assert(page_insert_zero(pgdir, (void *) PGSIZE, PTE_U | PTE_W) == 0);
+	assert(page_lookup(pgdir, (void *) PGSIZE, &pte) == zero_page);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(zero_page->pp_ref == ref + 1);
+
+	// ...and read-only memory just maps it
+	assert(page_insert_zero(pgdir, (void *) (2 * PGSIZE), PTE_U) == 0);
+	assert(page_lookup(pgdir, (void *) (2 * PGSIZE), &pte) == zero_page);
+	assert(!(*pte & (PTE_W | PTE_COW)));
+
+	// only writes to the copy-on-write one are resolved
+	e.env_pgdir = pgdir;
+	e.env_vm = NULL;
+	assert(page_fault_resolve(&e, PGSIZE, FEC_PR) == -E_FAULT);
+	assert(page_fault_resolve(&e, 2 * PGSIZE, FEC_PR | FEC_WR) == -E_FAULT);
+	assert(page_fault_resolve(&e, 3 * PGSIZE, FEC_WR) == -E_FAULT);
+	assert(page_fault_resolve(&e, PGSIZE + 4, FEC_PR | FEC_WR) == 0);
+	assert(zero_page_breaks == breaks + 1);
+	assert(page_lookup(pgdir, (void *) PGSIZE, &pte) != zero_page);
+	assert((*pte & (PTE_W | PTE_COW | PTE_U)) == (PTE_W | PTE_U));
+	kva = page_kmap(pa2page(PTE_ADDR(*pte)));
+	for (i = 0; i < PGSIZE; i++)
+		assert(kva[i] == 0);
+	page_kunmap(kva);
+
+	// the zero page itself is never written
+	kva = page2kva(zero_page);
+	for (i = 0; i < PGSIZE; i++)
+		assert(kva[i] == 0);
+
+	// fork hands a read-only mapping of it on read-only, and counted
+	assert((cp = page_alloc(ALLOC_ZERO)));
+	cp->pp_ref++;
+	cpgdir = page2kva(cp);
+	assert(page_fork_range(cpgdir, pgdir, PTSIZE, 0) == 0);
+	assert(page_lookup(cpgdir, (void *) (2 * PGSIZE), &pte) == zero_page);
+	assert(!(*pte & (PTE_W | PTE_COW)));
+	assert(zero_page->pp_ref == ref + 2);
+
+	// past ZERO_PAGE_MAXREF, mapping it again, as sys_page_map would,
+	// gets a zeroed page instead, so its pp_ref can't overflow
+	zero_page->pp_ref = ZERO_PAGE_MAXREF;
+	assert(page_insert(pgdir, zero_page, (void *) (3 * PGSIZE), PTE_U) == 0);
+	assert(page_lookup(pgdir, (void *) (3 * PGSIZE), &pte) != zero_page);
+	assert(!(*pte & (PTE_W | PTE_COW)));
+	assert(zero_page->pp_ref == ZERO_PAGE_MAXREF);
+	zero_page->pp_ref = ref + 2;
+
+	for (i = 1; i <= 3; i++) {
+		page_remove(pgdir, (void *) (i * PGSIZE));
+		page_remove(cpgdir, (void *) (i * PGSIZE));
+	}
+	assert(zero_page->pp_ref == ref);
+	assert(pgdir[0] == 0 && cpgdir[0] == 0);  // the page tables went too
+	page_decref(cp);
+	page_decref(pp);
+
+	cprintf("check_zero_page() succeeded!\n");
+}
+
+//
+// Check forking an address space copy-on-write, and breaking it.
+//
+static void
+check_cow(void)
+{
+	struct PageInfo *pd[2], *pp, *np, *dp, *sp;
+	struct Env e[2];
+	pte_t *pte;
+	char *kva;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		assert((pd[i] = page_alloc(ALLOC_ZERO)));
+		pd[i]->pp_ref++;
+		e[i].env_pgdir = page2kva(pd[i]);
+		e[i].env_vm = NULL;
+	}
+
+	// a writable page, a read-only one, a writable one that's been
+	// written to, and a stack page, forked
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), 0x42, PGSIZE);
+	assert(page_insert(e[0].env_pgdir, pp, (void *) PGSIZE, PTE_U | PTE_W) == 0);
+	assert((np = page_alloc(0)));
+	assert(page_insert(e[0].env_pgdir, np, (void *) (2 * PGSIZE), PTE_U) == 0);
+	assert((dp = page_alloc(0)));
+	memset(page2kva(dp), 0x17, PGSIZE);
+	assert(page_insert(e[0].env_pgdir, dp, (void *) (3 * PGSIZE), PTE_U | PTE_W) == 0);
+	*pgdir_walk(e[0].env_pgdir, (void *) (3 * PGSIZE), 0) |= PTE_D;
+	assert((sp = page_alloc(0)));
+	assert(page_insert(e[0].env_pgdir, sp, (void *) (4 * PGSIZE), PTE_U | PTE_W) == 0);
+	assert(page_fork_range(e[1].env_pgdir, e[0].env_pgdir, 5 * PGSIZE,
+			       4 * PGSIZE + 100) == 0);
+	assert(pp->pp_ref == 2 && np->pp_ref == 2);
+	for (i = 0; i < 2; i++) {
+		assert(page_lookup(e[i].env_pgdir, (void *) PGSIZE, &pte) == pp);
+		assert((*pte & (PTE_W | PTE_COW | PTE_U)) == (PTE_COW | PTE_U));
+		assert(page_lookup(e[i].env_pgdir, (void *) (2 * PGSIZE), &pte) == np);
+		assert(!(*pte & (PTE_W | PTE_COW)));
+	}
+
+	// the dirty page and the stack were copied, and stay writable in
+	// both, the parent's no longer dirty
+	assert(fork_eager_copies == 2);
+	assert(dp->pp_ref == 1 && sp->pp_ref == 1);
+	assert(page_lookup(e[0].env_pgdir, (void *) (3 * PGSIZE), &pte) == dp);
+	assert((*pte & (PTE_W | PTE_COW | PTE_D)) == PTE_W);
+	assert(page_lookup(e[1].env_pgdir, (void *) (3 * PGSIZE), &pte) != dp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	kva = page_kmap(pa2page(PTE_ADDR(*pte)));
+	for (i = 0; i < PGSIZE; i++)
+		assert(kva[i] == 0x17);
+	page_kunmap(kva);
+	assert(page_lookup(e[1].env_pgdir, (void *) (4 * PGSIZE), &pte) != sp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+
+	// left to the environment if the kernel's not doing it, and
+	// read-only pages are never the kernel's business
+	page_cow_kernel = false;
+	assert(page_fault_resolve(&e[1], PGSIZE, FEC_PR | FEC_WR) == -E_FAULT);
+	page_cow_kernel = true;
+	assert(page_fault_resolve(&e[1], 2 * PGSIZE, FEC_PR | FEC_WR) == -E_FAULT);
+
+	// the first write gets a copy...
+	assert(page_fault_resolve(&e[1], PGSIZE + 4, FEC_PR | FEC_WR) == 0);
+	assert(page_lookup(e[1].env_pgdir, (void *) PGSIZE, &pte) != pp);
+	assert((*pte & (PTE_W | PTE_COW | PTE_U)) == (PTE_W | PTE_U));
+	assert(pp->pp_ref == 1);
+	kva = page_kmap(pa2page(PTE_ADDR(*pte)));
+	for (i = 0; i < PGSIZE; i++)
+		assert(kva[i] == 0x42);
+	page_kunmap(kva);
+
+	// ...and the last reference just becomes writable
+	assert(page_fault_resolve(&e[0], PGSIZE, FEC_PR | FEC_WR) == 0);
+	assert(page_lookup(e[0].env_pgdir, (void *) PGSIZE, &pte) == pp);
+	assert((*pte & (PTE_W | PTE_COW | PTE_U)) == (PTE_W | PTE_U));
+	assert(cow_copies == 1 && cow_reuses == 1 && cow_upcalls == 1);
+
+	for (i = 0; i < 2; i++) {
+		page_remove(e[i].env_pgdir, (void *) PGSIZE);
+		page_remove(e[i].env_pgdir, (void *) (2 * PGSIZE));
+		page_remove(e[i].env_pgdir, (void *) (3 * PGSIZE));
+		page_remove(e[i].env_pgdir, (void *) (4 * PGSIZE));
+		assert(e[i].env_pgdir[0] == 0);
+		page_decref(pd[i]);
+	}
+	cow_copies = cow_reuses = cow_upcalls = fork_eager_copies = 0;
+	ptab_empty_frees = 0;
+
+	cprintf("check_cow() succeeded!\n");
+}
+
+//
+// Check forking with page tables shared copy-on-write, and unsharing
+// them again.
+//
+static void
+check_fork_share(void)
+{
+	struct PageInfo *pd[3], *pp, *np, *ptp;
+	struct Env e[3];
+	pte_t *pte;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		assert((pd[i] = page_alloc(ALLOC_ZERO)));
+		pd[i]->pp_ref++;
+		e[i].env_pgdir = page2kva(pd[i]);
+		e[i].env_vm = NULL;
+	}
+
+	// a writable page and a read-only one, in the second page table
+	// (the first has the stack, which is done page by page)
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), 0x42, PGSIZE);
+	assert(page_insert(e[0].env_pgdir, pp, (void *) PTSIZE, PTE_U | PTE_W) == 0);
+	assert((np = page_alloc(0)));
+	assert(page_insert(e[0].env_pgdir, np, (void *) (PTSIZE + PGSIZE), PTE_U) == 0);
+	ptp = pa2page(PTE_ADDR(e[0].env_pgdir[1]));
+
+	// forked twice, the page table is shared three ways and read-only,
+	// and its entries are as they were
+	assert(page_fork_range(e[1].env_pgdir, e[0].env_pgdir, 2 * PTSIZE, 0) == 0);
+	assert(page_fork_range(e[2].env_pgdir, e[0].env_pgdir, 2 * PTSIZE, 0) == 0);
+	assert(ptab_shares == 2 && ptp->pp_ref == 3);
+	for (i = 0; i < 3; i++) {
+		assert(pde_is_shared(e[i].env_pgdir[1]));
+		assert(!(e[i].env_pgdir[1] & PTE_W));
+		assert(PTE_ADDR(e[i].env_pgdir[1]) == page2pa(ptp));
+	}
+	assert(pp->pp_ref == 1 && np->pp_ref == 1);
+	assert(page_lookup(e[1].env_pgdir, (void *) PTSIZE, &pte) == pp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+
+	// writing a read-only page is no reason to copy the page table
+	assert(page_fault_resolve(&e[1], PTSIZE + PGSIZE, FEC_PR | FEC_WR) == -E_FAULT);
+	assert(ptab_copies == 0 && ptp->pp_ref == 3);
+
+	// the first write gets a copy of the page table, then of the page
+	assert(page_fault_resolve(&e[1], PTSIZE, FEC_PR | FEC_WR) == 0);
+	assert(ptab_copies == 1 && ptp->pp_ref == 2);
+	assert((e[1].env_pgdir[1] & (PTE_W | PTE_COW)) == PTE_W);
+	assert(PTE_ADDR(e[1].env_pgdir[1]) != page2pa(ptp));
+	assert(page_lookup(e[1].env_pgdir, (void *) PTSIZE, &pte) != pp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	assert(page_lookup(e[1].env_pgdir, (void *) (PTSIZE + PGSIZE), &pte) == np);
+	assert(pp->pp_ref == 1 && np->pp_ref == 2 && cow_copies == 1);
+
+	// so does unmapping, and the page left is copy-on-write now
+	page_remove(e[2].env_pgdir, (void *) PTSIZE);
+	assert(ptab_copies == 2 && ptp->pp_ref == 1);
+	assert(page_lookup(e[2].env_pgdir, (void *) PTSIZE, NULL) == NULL);
+	assert(pp->pp_ref == 1 && np->pp_ref == 3);
+	assert(page_lookup(e[0].env_pgdir, (void *) PTSIZE, &pte) == pp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+
+	// the last one using the page table just takes it back, and then
+	// the page too
+	assert(page_fault_resolve(&e[0], PTSIZE, FEC_PR | FEC_WR) == 0);
+	assert(ptab_reclaims == 1 && ptp->pp_ref == 1);
+	assert((e[0].env_pgdir[1] & (PTE_W | PTE_COW)) == PTE_W);
+	assert(PTE_ADDR(e[0].env_pgdir[1]) == page2pa(ptp));
+	assert(page_lookup(e[0].env_pgdir, (void *) PTSIZE, &pte) == pp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	assert(cow_copies == 1 && cow_reuses == 1);
+
+	// each page table goes once its last page is unmapped, whether it
+	// was copied or taken back
+	ptab_empty_frees = 0;
+	for (i = 0; i < 3; i++) {
+		page_remove(e[i].env_pgdir, (void *) PTSIZE);
+		assert(e[i].env_pgdir[1] != 0);
+		page_remove(e[i].env_pgdir, (void *) (PTSIZE + PGSIZE));
+		assert(e[i].env_pgdir[1] == 0 && ptab_empty_frees == i + 1);
+		page_decref(pd[i]);
+	}
+	assert(np->pp_ref == 0 && ptp->pp_ref == 0);
+	ptab_shares = ptab_copies = ptab_reclaims = ptab_empty_frees = 0;
+	cow_copies = cow_reuses = 0;
+
+	cprintf("check_fork_share() succeeded!\n");
+}
+
+//
+// Check coloured page allocation.
+//
+static void
+check_page_color(void)
+{
+	struct PageInfo *pp[2 * PAGE_NCOLORS_MAX];
+	bool was_enabled = page_color_enabled;
+	int i, n = 2 * page_ncolors;
+	int *kva;
+
+	page_color_enable(true);
+
+	// consecutive pages of an address space get consecutive colours
+	for (i = 0; i < n; i++) {
+		assert((pp[i] = page_alloc_user(kern_pgdir, UTEXT + i * PGSIZE, ALLOC_ZERO)));
+		assert(page_color(pp[i]) == (page_color(pp[0]) + i) % page_ncolors);
+		assert(!(pp[i]->pp_flags & PP_COLOR) && !pp[i]->pp_link);
+		kva = page_kmap(pp[i]);
+		assert(kva[0] == 0 && kva[PGSIZE / sizeof(int) - 1] == 0);
+		page_kunmap(kva);
+	}
+
+	// freed pages go back in their bin, and come out for the same colour
+	page_free(pp[1]);
+	assert(pp[1]->pp_flags & PP_COLOR);
+	assert(page_alloc_user(kern_pgdir, UTEXT + PGSIZE, 0) == pp[1]);
+	for (i = 0; i < n; i++)
+		page_free(pp[i]);
+
+	// turning colouring off gives them all back
+	page_color_enable(false);
+	assert(color_nbinned == 0);
+	page_color_enable(was_enabled);
+
+	cprintf("check_page_color() succeeded!\n");
+}
@@ -14,6 +14,8 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern size_t npages_direct;
+extern struct PageInfo *zero_page;
 
 extern pde_t *kern_pgdir;
 
@@ -36,7 +38,8 @@ _paddr(const char *file, int line, void *kva)
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address.
+ * virtual address.  It panics if you pass an invalid physical address,
+ * including one of the pages above the KERNBASE map (see page_kmap).
  *
  * Just adds KERNBASE to the given pa and casts to void *.
  */
@@ -45,7 +48,7 @@ _paddr(const char *file, int line, void *kva)
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages_direct)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
@@ -54,24 +57,136 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,  // TODO what's the point of shifting this 0?
+	// For page_alloc, the page may come from above the KERNBASE map,
+	// where the kernel can only get at it through page_kmap.
+	ALLOC_HIGH = 1<<1,
+};
+
+// How much physical memory entry_pgdir maps at KERNBASE, and so how
+// much boot_alloc can hand out before mem_init loads kern_pgdir.
+#define ENTRY_MAPSIZE	(4 * PTSIZE)
+
+// Pages of kmap window each CPU has, at KMAPBASE (see page_kmap)
+#define KMAP_NSLOTS	4
+
+// Largest block the buddy allocator hands out: 2^PAGE_MAX_ORDER pages,
+// which is exactly PTSIZE (one 4MB superpage).
+#define PAGE_MAX_ORDER	10
+
+// Order of the block backing a 4MB user huge page (a PTE_PS mapping)
+#define PAGE_HUGE_ORDER	(PTSHIFT - PGSHIFT)
+
+// Most page colours page_alloc_user tells apart. Also an upper bound on
+// the order of the blocks the colour bins are refilled with.
+#define PAGE_NCOLORS_MAX	64
+
+// Whether page colouring starts out on; set with 'make PAGECOLOR=1'
+#ifndef PAGE_COLOR
+#define PAGE_COLOR	0
+#endif
+
+// Values of pp_flags in struct PageInfo
+#define PP_FREE		0x01	// Heads a free block on a buddy free list
+#define PP_PCP		0x02	// On a per-CPU page cache
+#define PP_ZERO		0x04	// On the pool of pre-zeroed pages
+#define PP_KSM		0x08	// Shared by merging identical pages (ksm.c)
+#define PP_COLOR	0x10	// In a colour bin (see page_alloc_user)
+#define PP_VMPOOL	0x20	// On a page directory or page table pool
+#define PP_STOLEN	0x80	// Held back from the free lists by the checks
+
+// Past this many addresses to invalidate at once, it's cheaper (and
+// simpler) to flush the whole TLB instead.
+#define TLB_FLUSH_THRESHOLD	16
+
+// Iterator over the page table entries mapping a range of addresses, for
+// operations on many pages at once: pte_range_next only walks down from
+// the page directory once per page table, and skips a missing page table
+// in one step. Callers may change the entries in place; the TLB
+// invalidations that needs are collected (see pte_range_invalidate) and
+// done all at once, as are the page frees from pte_range_remove, which
+// have to wait until no TLB can still be using the page.
+#define PTE_RANGE_CREATE	0x1	// Visit every entry, making page tables
+#define PTE_RANGE_NPUT		32	// Pages pte_range_remove holds at once
+
+struct PteRange {
+	pde_t *pr_pgdir;
+	int pr_flags;			// PTE_RANGE_*
+	int pr_error;			// Set if PTE_RANGE_CREATE ran out of memory
+	uintptr_t pr_va;		// Address of the last entry returned
+	uintptr_t pr_next;		// Next address to look at
+	size_t pr_left;			// Bytes left to look at from pr_next
+	int pr_ninval;			// Entries in pr_inval; > max means all
+	uintptr_t pr_inval[TLB_FLUSH_THRESHOLD];
+	int pr_nput;			// Pages in pr_put
+	struct PageInfo *pr_put[PTE_RANGE_NPUT];
 };
 
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_user(pde_t *pgdir, uintptr_t va, int alloc_flags);
+void	page_color_enable(bool on);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_zero_pool_fill(void);
+struct PageInfo *pgdir_alloc(void);
+void	pgdir_free(struct PageInfo *pp);
+void	pgdir_pool_fill(void);
+struct PageInfo *page_table_alloc(void);
+void	page_table_free(struct PageInfo *pp);
+void *	page_kmap(struct PageInfo *pp);
+void	page_kunmap(void *kva);
+void	print_page_stats(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	pte_range_begin(struct PteRange *r, pde_t *pgdir, uintptr_t va, size_t len, int flags);
+pte_t *	pte_range_next(struct PteRange *r);
+void	pte_range_invalidate(struct PteRange *r);
+void	pte_range_remove(struct PteRange *r, pte_t *pte);
+void	pte_range_put(struct PteRange *r, struct PageInfo *pp);
+int	pte_range_end(struct PteRange *r);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush_pgdir(pde_t *pgdir);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_drain(void);
+void	tlb_enter_user(void);
+void	tlb_leave_user(void);
+void	print_tlb_stats(void);
+void	check_tlb_shootdown(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
+// page_insert_zero maps a fresh page instead of the zero page once it
+// has this many references, so its pp_ref can't overflow
+#define ZERO_PAGE_MAXREF	0xff00
+
+int	page_insert_zero(pde_t *pgdir, void *va, int perm);
+int	page_zero_break(pde_t *pgdir, void *va);
+int	page_fault_resolve(struct Env *e, uintptr_t va, uint32_t err);
+int	page_fork_range(pde_t *dst, pde_t *src, uintptr_t end, uintptr_t stack);
+int	page_table_unshare(pde_t *pgdir, uintptr_t va);
+
+// Default for page_fork_eager: how many recently written pages (besides
+// the stack) page_fork_range copies to the child rather than sharing
+#define PAGE_FORK_EAGER		8
+
+extern bool page_cow_kernel;
+extern int page_fork_eager;
+extern bool page_fork_share;
+
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void	user_mem_fault(struct Env *env);
+int	copyin(void *dst, const void *usrc, size_t len);
+int	copyout(void *udst, const void *src, size_t len);
+int	copyinstr(char *dst, const char *usrc, size_t size);
 
 /* PageInfo* -> PFA of the page it corresponds to
  *
@@ -86,10 +201,9 @@ page2pa(struct PageInfo *pp)
 	// pp and pages are pointers of the same type. Thus, subraction scales; i.e.
 	// (pp - pages) evaluates to the number of `PageInfo` structs between the two
 	// addresses, exclusive.
-	// (pp - pages) assembles to subtracting the addresses and then >>3. This
-	// divides by 8, which gives you the number of PageInfo structs between
-	// the two addresses. sizeof(PageInfo) == 8 because it needs 2 bytes of
-	// trailing padding to be self-aligned.
+	// (pp - pages) assembles to subtracting the addresses and then dividing
+	// by sizeof(PageInfo) (16, so just a shift), which gives you the
+	// number of PageInfo structs between the two addresses.
 	return (pp - pages) << PGSHIFT;
 }
 
@@ -117,6 +231,29 @@ page2kva(struct PageInfo *pp)
 	return KADDR(page2pa(pp));
 }
 
+/* Count 'n' more (or fewer) present entries in the page table holding
+ * 'pte', as it's made present (or cleared).
+ */
+static inline void
+page_table_count(pte_t *pte, int n)
+{
+	pa2page(PADDR(ROUNDDOWN(pte, PGSIZE)))->pp_nptes += n;
+}
+
+/* Is 'pde' a page table shared copy-on-write since a fork?
+ *
+ * page_fork_range hands whole page tables down to the child, rather than
+ * copying their entries: the page directory entries on both sides lose
+ * PTE_W and get PTE_COW, and the page table's pp_ref counts the page
+ * directories using it. Nothing in it may change until
+ * page_table_unshare has given the page directory its own.
+ */
+static inline bool
+pde_is_shared(pde_t pde)
+{
+	return (pde & (PTE_P | PTE_PS | PTE_COW)) == (PTE_P | PTE_COW);
+}
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 #endif /* !JOS_KERN_PMAP_H */
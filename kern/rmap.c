@@ -0,0 +1,480 @@
+/* See COPYRIGHT for copyright information. */
+
+// Reverse mappings: for each frame, the page table entries that map it,
+// so the kernel can find every address space using a frame (to move
+// it, reclaim it, or merge it) without searching them all.
+//
+// A frame's pp_rmap is
+//
+//  - 0, if nothing maps it,
+//  - the kernel virtual address of the one entry that does, which is
+//    the usual case, and costs nothing but the field itself,
+//  - or, with RMAP_CHAIN set, a chain of RmapNodes holding the entries,
+//    for a frame mapped more than once (shared copy-on-write after a
+//    fork, sys_page_map'd, or merged by ksm.c).
+//
+// The entries are where the page is mapped in a page table, or for a
+// huge page the PTE_PS page directory entry. A page table is a frame
+// like any other, mapped by page directory entries: one, or several if
+// it's shared since a fork (see pde_is_shared). So rmap_walk goes from
+// a page's entries to their page tables' entries to find the page
+// directories and virtual addresses.
+//
+// Entries are added and removed wherever the kernel maps and unmaps
+// pages (page_insert, page_remove, pte_range_remove, fork, ksm.c), and
+// a page that's freed forgets whatever was left. The shared zero page
+// isn't tracked at all: it can have tens of thousands of mappings, and
+// there's no reason to ever move it.
+//
+// Like the rest of the kernel, this relies on the big kernel lock.
+
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/rmap.h>
+
+// Tag in pp_rmap for a chain, rather than a single entry. Entries are
+// 4-byte aligned, nodes more so, so bit 0 is otherwise always clear.
+#define RMAP_CHAIN	0x1
+
+// A link of a frame's chain. The entries are packed from the start of
+// each node, and only the first node may have room left, so adding an
+// entry never has to look past it.
+struct RmapNode {
+	pte_t *rn_ptes[RMAP_NODE_PTES];	// NULL past the last entry
+	struct RmapNode *rn_next;
+};
+
+static struct kmem_cache *rmap_node_cache;
+
+// Statistics, reported by the 'rmapinfo' monitor command
+static struct {
+	uint32_t rs_nsingle;		// Frames with a single entry
+	uint32_t rs_nchained;		// Frames with a chain
+	uint32_t rs_nnodes;		// RmapNodes in use
+	uint32_t rs_nadds;		// Entries added
+	uint32_t rs_nremoves;		// Entries removed
+	uint64_t rs_add_cycles;		// Time spent adding them
+	uint64_t rs_remove_cycles;	// Time spent removing them
+} rmap_stats;
+
+static void check_rmap(void);
+
+//
+// Start keeping track of mappings. Call after kmem_init; mappings made
+// before then aren't tracked.
+//
+void
+rmap_init(void)
+{
+	if (!(rmap_node_cache = kmem_cache_create("rmap_node", sizeof(struct RmapNode))))
+		panic("rmap_init: out of memory");
+	check_rmap();
+}
+
+static struct RmapNode *
+rmap_chain(struct PageInfo *pp)
+{
+	return (struct RmapNode *) (pp->pp_rmap & ~RMAP_CHAIN);
+}
+
+static int
+rmap_node_count(struct RmapNode *rn)
+{
+	int n = 0;
+
+	while (n < RMAP_NODE_PTES && rn->rn_ptes[n])
+		n++;
+	return n;
+}
+
+//
+// Record that 'pte' maps 'pp'.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the chain couldn't be grown, in which case nothing
+//     changed
+//
+int
+rmap_add(struct PageInfo *pp, pte_t *pte)
+{
+	struct RmapNode *rn, *spare = NULL;
+	uint64_t start;
+	int n;
+
+	if (!rmap_node_cache || pp == zero_page)
+		return 0;
+	start = read_tsc();
+
+	// Allocating a node may reap environments, and so change pp's
+	// entries, so look again after each allocation.
+	for (;;) {
+		if (!pp->pp_rmap) {
+			pp->pp_rmap = (uintptr_t) pte;
+			rmap_stats.rs_nsingle++;
+			break;
+		}
+		if (pp->pp_rmap & RMAP_CHAIN) {
+			rn = rmap_chain(pp);
+			if ((n = rmap_node_count(rn)) < RMAP_NODE_PTES) {
+				rn->rn_ptes[n] = pte;
+				break;
+			}
+		}
+		if (!spare) {
+			if (!(spare = kmem_cache_alloc(rmap_node_cache)))
+				return -E_NO_MEM;
+			memset(spare, 0, sizeof(*spare));
+			rmap_stats.rs_nnodes++;
+			continue;
+		}
+
+		// Start a new node at the front of the chain, or make the
+		// single entry a chain
+		if (pp->pp_rmap & RMAP_CHAIN) {
+			spare->rn_ptes[0] = pte;
+			spare->rn_next = rmap_chain(pp);
+		} else {
+			spare->rn_ptes[0] = (pte_t *) pp->pp_rmap;
+			spare->rn_ptes[1] = pte;
+			rmap_stats.rs_nsingle--;
+			rmap_stats.rs_nchained++;
+		}
+		pp->pp_rmap = (uintptr_t) spare | RMAP_CHAIN;
+		spare = NULL;
+		break;
+	}
+
+	if (spare) {
+		kmem_cache_free(rmap_node_cache, spare);
+		rmap_stats.rs_nnodes--;
+	}
+	rmap_stats.rs_nadds++;
+	rmap_stats.rs_add_cycles += read_tsc() - start;
+	return 0;
+}
+
+//
+// Forget that 'pte' maps 'pp'. (If it was mapped before rmap_init, it
+// was never recorded, and there's nothing to do.)
+//
+void
+rmap_remove(struct PageInfo *pp, pte_t *pte)
+{
+	struct RmapNode *head, *rn;
+	uint64_t start;
+	int i, n;
+
+	if (!rmap_node_cache || !pp->pp_rmap)
+		return;
+	start = read_tsc();
+
+	if (!(pp->pp_rmap & RMAP_CHAIN)) {
+		if ((pte_t *) pp->pp_rmap != pte)
+			return;
+		pp->pp_rmap = 0;
+		rmap_stats.rs_nsingle--;
+		goto done;
+	}
+
+	// Most recently added first, which is usually what goes first
+	head = rmap_chain(pp);
+	for (rn = head; rn; rn = rn->rn_next)
+		for (i = 0; i < RMAP_NODE_PTES && rn->rn_ptes[i]; i++)
+			if (rn->rn_ptes[i] == pte)
+				goto found;
+	return;
+
+found:
+	// Fill the hole with the first node's last entry, keeping the
+	// nodes packed, and let go of the first node if that empties it
+	n = rmap_node_count(head);
+	rn->rn_ptes[i] = head->rn_ptes[n - 1];
+	head->rn_ptes[n - 1] = NULL;
+	if (n == 1) {
+		pp->pp_rmap = (uintptr_t) head->rn_next | RMAP_CHAIN;
+		kmem_cache_free(rmap_node_cache, head);
+		rmap_stats.rs_nnodes--;
+		head = rmap_chain(pp);
+	}
+
+	// Back to a single entry, without a chain
+	if (!head->rn_next && !head->rn_ptes[1]) {
+		pp->pp_rmap = (uintptr_t) head->rn_ptes[0];
+		kmem_cache_free(rmap_node_cache, head);
+		rmap_stats.rs_nnodes--;
+		rmap_stats.rs_nchained--;
+		rmap_stats.rs_nsingle++;
+	}
+
+done:
+	rmap_stats.rs_nremoves++;
+	rmap_stats.rs_remove_cycles += read_tsc() - start;
+}
+
+//
+// Call 'fn' for each entry recorded for 'pp', until it returns nonzero.
+// Returns what fn last returned, or 0 if there were no entries.
+//
+static int
+rmap_foreach(struct PageInfo *pp, int (*fn)(pte_t *pte, void *arg), void *arg)
+{
+	struct RmapNode *rn;
+	int i, r;
+
+	if (!(pp->pp_rmap & RMAP_CHAIN))
+		return pp->pp_rmap ? fn((pte_t *) pp->pp_rmap, arg) : 0;
+	for (rn = rmap_chain(pp); rn; rn = rn->rn_next)
+		for (i = 0; i < RMAP_NODE_PTES && rn->rn_ptes[i]; i++)
+			if ((r = fn(rn->rn_ptes[i], arg)))
+				return r;
+	return 0;
+}
+
+struct RmapWalk {
+	rmap_fn_t rw_fn;
+	void *rw_arg;
+	pte_t *rw_pte;		// The page's entry, in the page table
+};
+
+// rmap_walk, for one of the page directory entries pointing at the
+// page table that holds rw->rw_pte
+static int
+rmap_walk_pde(pte_t *pde, void *arg)
+{
+	struct RmapWalk *rw = arg;
+	pde_t *pgdir = ROUNDDOWN(pde, PGSIZE);
+	pte_t *pt = ROUNDDOWN(rw->rw_pte, PGSIZE);
+
+	return rw->rw_fn(pgdir, (uintptr_t) PGADDR(pde - pgdir, rw->rw_pte - pt, 0),
+			 rw->rw_pte, rw->rw_arg);
+}
+
+// rmap_walk, for one of the page's own entries
+static int
+rmap_walk_pte(pte_t *pte, void *arg)
+{
+	struct RmapWalk *rw = arg;
+	pte_t *pt = ROUNDDOWN(pte, PGSIZE);
+
+	// A huge page's entry is in the page directory itself
+	if (*pte & PTE_PS)
+		return rw->rw_fn(pt, (uintptr_t) PGADDR(pte - pt, 0, 0), pte,
+				 rw->rw_arg);
+
+	rw->rw_pte = pte;
+	return rmap_foreach(pa2page(PADDR(pt)), rmap_walk_pde, rw);
+}
+
+//
+// Call 'fn' for each place 'pp' is mapped: the page directory, the
+// virtual address, and the entry that maps it there. A page in a page
+// table shared since a fork is visited once for each page directory
+// sharing it, with the same entry each time. The walk stops at the
+// first nonzero return from fn, which rmap_walk returns; otherwise it
+// returns 0.
+//
+// fn must not change pp's mappings, or those of its page tables.
+//
+int
+rmap_walk(struct PageInfo *pp, rmap_fn_t fn, void *arg)
+{
+	struct RmapWalk rw;
+
+	rw.rw_fn = fn;
+	rw.rw_arg = arg;
+	return rmap_foreach(pp, rmap_walk_pte, &rw);
+}
+
+//
+// Called by page_free_order for a page that still has entries recorded,
+// which only the kernel's own checks leave behind, when they tear down
+// page tables by hand.
+//
+void
+rmap_page_freed(struct PageInfo *pp)
+{
+	struct RmapNode *rn;
+
+	if (!(pp->pp_rmap & RMAP_CHAIN)) {
+		rmap_stats.rs_nsingle--;
+		pp->pp_rmap = 0;
+		return;
+	}
+	while ((rn = rmap_chain(pp))) {
+		pp->pp_rmap = (uintptr_t) rn->rn_next | RMAP_CHAIN;
+		kmem_cache_free(rmap_node_cache, rn);
+		rmap_stats.rs_nnodes--;
+	}
+	pp->pp_rmap = 0;
+	rmap_stats.rs_nchained--;
+}
+
+//
+// Print what the reverse mappings cost, in memory and in time.
+//
+void
+print_rmap_stats(void)
+{
+	cprintf("frames mapped once: %u, more than once: %u\n",
+		rmap_stats.rs_nsingle, rmap_stats.rs_nchained);
+	cprintf("memory: %uK in struct PageInfo, %u chain nodes of %u bytes "
+		"(%uK)\n", npages * sizeof(pages[0].pp_rmap) / 1024,
+		rmap_stats.rs_nnodes, sizeof(struct RmapNode),
+		rmap_stats.rs_nnodes * sizeof(struct RmapNode) / 1024);
+	cprintf("adds: %u", rmap_stats.rs_nadds);
+	if (rmap_stats.rs_nadds)
+		cprintf(", %llu cycles average",
+			rmap_stats.rs_add_cycles / rmap_stats.rs_nadds);
+	cprintf("\nremoves: %u", rmap_stats.rs_nremoves);
+	if (rmap_stats.rs_nremoves)
+		cprintf(", %llu cycles average",
+			rmap_stats.rs_remove_cycles / rmap_stats.rs_nremoves);
+	cprintf("\n");
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_RMAP_MAX	16
+
+struct CheckRmap {
+	int cr_n;
+	pde_t *cr_pgdir[CHECK_RMAP_MAX];
+	uintptr_t cr_va[CHECK_RMAP_MAX];
+	int cr_stop;		// Stop the walk after this many, if nonzero
+};
+
+static int
+check_rmap_fn(pde_t *pgdir, uintptr_t va, pte_t *pte, void *arg)
+{
+	struct CheckRmap *cr = arg;
+
+	assert(cr->cr_n < CHECK_RMAP_MAX);
+	assert(pgdir_walk(pgdir, (void *) va, 0) == pte);
+	cr->cr_pgdir[cr->cr_n] = pgdir;
+	cr->cr_va[cr->cr_n] = va;
+	cr->cr_n++;
+	return cr->cr_n == cr->cr_stop ? -1 : 0;
+}
+
+// Walk pp's mappings, and check there are 'n' of them.
+static struct CheckRmap *
+check_rmap_walk(struct PageInfo *pp, int n)
+{
+	static struct CheckRmap cr;
+
+	memset(&cr, 0, sizeof(cr));
+	assert(rmap_walk(pp, check_rmap_fn, &cr) == 0);
+	assert(cr.cr_n == n);
+	return &cr;
+}
+
+// Was 'va' in 'pgdir' among the mappings walked?
+static bool
+check_rmap_found(struct CheckRmap *cr, pde_t *pgdir, uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < cr->cr_n; i++)
+		if (cr->cr_pgdir[i] == pgdir && cr->cr_va[i] == va)
+			return true;
+	return false;
+}
+
+static void
+check_rmap(void)
+{
+	struct PageInfo *pd[2], *pp;
+	struct CheckRmap *cr, stop;
+	bool share = page_fork_share;
+	pde_t *pgdir[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		assert((pd[i] = page_alloc(ALLOC_ZERO)));
+		pd[i]->pp_ref++;
+		pgdir[i] = page2kva(pd[i]);
+	}
+	assert((pp = page_alloc(0)));
+
+	// one mapping is a single entry, a second makes it a chain
+	assert(page_insert(pgdir[0], pp, (void *) PTSIZE, PTE_U | PTE_W) == 0);
+	assert(pp->pp_rmap && !(pp->pp_rmap & RMAP_CHAIN));
+	cr = check_rmap_walk(pp, 1);
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE));
+	assert(page_insert(pgdir[0], pp, (void *) (PTSIZE + PGSIZE), PTE_U) == 0);
+	assert(pp->pp_rmap & RMAP_CHAIN);
+	cr = check_rmap_walk(pp, 2);
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE + PGSIZE));
+
+	// more than a node's worth
+	for (i = 0; i < RMAP_NODE_PTES; i++)
+		assert(page_insert(pgdir[0], pp, (void *) (2 * PTSIZE + i * PGSIZE),
+				   PTE_U) == 0);
+	assert(rmap_chain(pp)->rn_next);
+	cr = check_rmap_walk(pp, RMAP_NODE_PTES + 2);
+	for (i = 0; i < RMAP_NODE_PTES; i++)
+		assert(check_rmap_found(cr, pgdir[0], 2 * PTSIZE + i * PGSIZE));
+
+	// the walk stops when asked
+	memset(&stop, 0, sizeof(stop));
+	stop.cr_stop = 3;
+	assert(rmap_walk(pp, check_rmap_fn, &stop) == -1 && stop.cr_n == 3);
+
+	// unmapping them, from the middle of the chain, leaves the others,
+	// and the page table they were in goes with them
+	for (i = 0; i < RMAP_NODE_PTES; i++)
+		page_remove(pgdir[0], (void *) (2 * PTSIZE + i * PGSIZE));
+	assert(pgdir[0][2] == 0);
+	cr = check_rmap_walk(pp, 2);
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE));
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE + PGSIZE));
+
+	// a page table shared by fork shows the page in both page
+	// directories, at the same entries
+	page_fork_share = true;
+	assert(page_fork_range(pgdir[1], pgdir[0], 2 * PTSIZE, 0) == 0);
+	assert(pde_is_shared(pgdir[1][1]));
+	cr = check_rmap_walk(pp, 4);
+	assert(check_rmap_found(cr, pgdir[1], PTSIZE));
+	assert(check_rmap_found(cr, pgdir[1], PTSIZE + PGSIZE));
+
+	// and once unshared, pgdir[1] has a page table of its own
+	page_remove(pgdir[1], (void *) PTSIZE);
+	assert(!pde_is_shared(pgdir[1][1]));
+	cr = check_rmap_walk(pp, 3);
+	assert(!check_rmap_found(cr, pgdir[1], PTSIZE));
+	assert(check_rmap_found(cr, pgdir[1], PTSIZE + PGSIZE));
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE));
+
+	// down to one, it's a single entry again, then nothing
+	page_remove(pgdir[1], (void *) (PTSIZE + PGSIZE));
+	page_remove(pgdir[0], (void *) (PTSIZE + PGSIZE));
+	assert(pp->pp_rmap && !(pp->pp_rmap & RMAP_CHAIN));
+	cr = check_rmap_walk(pp, 1);
+	assert(check_rmap_found(cr, pgdir[0], PTSIZE));
+	page_remove(pgdir[0], (void *) PTSIZE);
+	assert(!pp->pp_rmap);
+
+	// Clean up; the page tables were freed as they emptied, and forgot
+	// their page directory entries
+	for (i = 0; i < 2; i++) {
+		assert(pgdir[i][1] == 0);
+		page_decref(pd[i]);
+	}
+	page_fork_share = share;
+	assert(rmap_stats.rs_nnodes == 0);
+	memset(&rmap_stats, 0, sizeof(rmap_stats));
+
+	cprintf("check_rmap() succeeded!\n");
+}
@@ -0,0 +1,26 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_RMAP_H
+#define JOS_KERN_RMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Page table entries in each link of a frame's rmap chain
+#define RMAP_NODE_PTES	7
+
+// Called by rmap_walk for each mapping of a frame: 'pte' maps the frame
+// at 'va' in 'pgdir'. A nonzero return stops the walk.
+typedef int (*rmap_fn_t)(pde_t *pgdir, uintptr_t va, pte_t *pte, void *arg);
+
+void	rmap_init(void);
+int	rmap_add(struct PageInfo *pp, pte_t *pte);
+void	rmap_remove(struct PageInfo *pp, pte_t *pte);
+int	rmap_walk(struct PageInfo *pp, rmap_fn_t fn, void *arg);
+void	rmap_page_freed(struct PageInfo *pp);
+void	print_rmap_stats(void);
+
+#endif	// !JOS_KERN_RMAP_H
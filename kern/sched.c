@@ -3,6 +3,7 @@
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/ksm.h>
 #include <kern/monitor.h>
 
 void sched_halt(void);
@@ -40,13 +41,18 @@ sched_yield(void)
 	// Loop through every env except for the currently running one,
 	// looking for a runnable.
 	int i;
-	for (i = 0; i < NENV; i++) {
-		env_idx = (env_idx + 1) % NENV;
-		if (envs[env_idx].env_status == ENV_RUNNABLE) {
-			next = &envs[env_idx];
+	for (i = 0; i < nenvs; i++) {
+		env_idx = (env_idx + 1) % nenvs;
+		if (env_at(env_idx)->env_status == ENV_RUNNABLE) {
+			next = env_at(env_idx);
 			break;
 		}
 	}
+	// Let the reaper have a go first. It doesn't do much at a time,
+	// but it has to keep up even when no CPU is ever idle (such as
+	// when environments spin waiting for another to be freed).
+	env_reap(REAP_BATCH);
+
 	if (next)
 		env_run(next);  // Does not return
 
@@ -64,13 +70,15 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	for (i = 0; i < nenvs; i++) {
+		if ((env_at(i)->env_status == ENV_RUNNABLE ||
+		     env_at(i)->env_status == ENV_RUNNING ||
+		     env_at(i)->env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == nenvs) {
+		// Leave nothing half torn down for the monitor
+		env_reap_all();
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -80,6 +88,19 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// Nothing to run, so put the time to use tearing down freed
+	// environments while we still hold the kernel lock,
+	env_reap(REAP_BATCH);
+
+	// ... zeroing pages for page_alloc(ALLOC_ZERO),
+	page_zero_pool_fill();
+
+	// ... and making page directories for new environments
+	pgdir_pool_fill();
+
+	// ... and looking for identical pages to merge
+	ksm_scan();
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
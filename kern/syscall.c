@@ -12,18 +12,46 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 
+// sys_exofork, sys_fork and sys_page_map latency, for 'envinfo'
+struct CallStats {
+	uint32_t fs_count;		// Successful calls
+	uint64_t fs_cycles;		// Total time spent in them
+	uint64_t fs_max_cycles;		// Longest single call
+};
+static struct CallStats exofork_stats, fork_stats, page_map_stats;
+
+// Count a successful call that started at TSC 'start'
+static void
+call_stats_add(struct CallStats *fs, uint64_t start)
+{
+	uint64_t cycles = read_tsc() - start;
+
+	fs->fs_count++;
+	fs->fs_cycles += cycles;
+	if (cycles > fs->fs_max_cycles)
+		fs->fs_max_cycles = cycles;
+}
+
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
 static void
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not (user_mem_assert won't return in that case)
-	user_mem_assert(curenv, s, len, 0);
-
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	char buf[256];
+	size_t n;
+
+	// Copy the string in a bufferful at a time, and print it.
+	// Destroy the environment if it can't read memory [s, s+len)
+	// (user_mem_fault won't return in that case).
+	while (len) {
+		n = MIN(len, sizeof(buf));
+		if (copyin(buf, s, n) < 0)
+			user_mem_fault(curenv);
+		cprintf("%.*s", n, buf);
+		s += n;
+		len -= n;
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -76,6 +104,7 @@ sys_yield(void)
 static envid_t
 sys_exofork(void)
 {
+	uint64_t start = read_tsc();
 	struct Env *e;
 	int err;
 
@@ -85,8 +114,60 @@ sys_exofork(void)
 	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_tf = curenv->env_tf;  // Copy register state
 	e->env_tf.tf_regs.reg_eax = 0;  // Return 0 in child
+	env_vm_share(e, curenv);  // Child pages in what the parent hasn't
+
+	call_stats_add(&exofork_stats, start);
+	return e->env_id;
+}
+
+// Fork the current environment: a new, runnable environment with a
+// copy of our registers (but returning 0) and of our address space up
+// to USTACKTOP, mostly shared copy-on-write (see page_fork_range), and our page
+// fault upcall. Its user exception stack is a fresh page of its own.
+// This is everything lib/fork.c's fork used to do with sys_exofork and
+// a system call or two per page, in one go.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	uint64_t start = read_tsc();
+	struct PageInfo *pp;
+	struct Env *e;
+	int err;
+
+	if (err = env_alloc(&e, curenv->env_id))
+		return err;
+
+	e->env_tf = curenv->env_tf;  // Copy register state
+	e->env_tf.tf_regs.reg_eax = 0;  // Return 0 in child
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env_vm_share(e, curenv);  // Child pages in what the parent hasn't
+
+	if ((err = page_fork_range(e->env_pgdir, curenv->env_pgdir, USTACKTOP,
+				   curenv->env_tf.tf_esp)) < 0)
+		goto fail;
+
+	// Neither user exception stack is ever copy-on-write
+	err = -E_NO_MEM;
+	if (!(pp = page_alloc_user(e->env_pgdir, UXSTACKTOP - PGSIZE,
+				     ALLOC_ZERO | ALLOC_HIGH)))
+		goto fail;
+	if ((err = page_insert(e->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+			       PTE_P | PTE_U | PTE_W)) < 0) {
+		page_free(pp);
+		goto fail;
+	}
 
+	e->env_status = ENV_RUNNABLE;
+	call_stats_add(&fork_stats, start);
 	return e->env_id;
+
+fail:
+	env_free(e);
+	return err;
 }
 
 // Set envid's env_status to status, which must be ENV_RUNNABLE
@@ -142,17 +223,23 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
-// The page's contents are set to 0.
+// The page's contents are set to 0. (A single page is really the shared
+// zero page, mapped copy-on-write, until it's first written to.)
 // If a page is already mapped at 'va', that page is unmapped as a
 // side effect.
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         Except: PTE_PS may be set too, to allocate a 4MB huge page
+//         (PTSIZE bytes of physically contiguous memory, mapped by a
+//         single page directory entry) in place of everything mapped in
+//         [va, va+PTSIZE).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if perm has PTE_PS, but va is not PTSIZE-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -164,13 +251,10 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_INVAL;
 
 	// Check permissions
-	if (perm & ~PTE_SYSCALL || !(perm & PTE_U) || !(perm & PTE_P))
+	if (perm & ~(PTE_SYSCALL|PTE_PS) || !(perm & PTE_U) || !(perm & PTE_P))
+		return -E_INVAL;
+	if (perm & PTE_PS && (uint32_t)va % PTSIZE != 0)
 		return -E_INVAL;
-
-	// Allocate a physical page
-	struct PageInfo *p;
-	if ((p = page_alloc(ALLOC_ZERO)) == NULL)
-		return -E_NO_MEM;
 
 	// Get the Env struct for given env_id,
 	// checking if curenv is allowed to modify
@@ -179,9 +263,22 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (err = envid2env(envid, &e, 1))
 		return err;
 
+	// A single page starts out as the shared zero page, and only gets
+	// a frame of its own when it's first written to.
+	if (!(perm & PTE_PS))
+		return page_insert_zero(e->env_pgdir, va, perm);
+
+	// Allocate 1024 contiguous pages for a huge page. The user only
+	// ever gets at it through its own mappings, so it may as well come
+	// from high memory.
+	struct PageInfo *p;
+	p = page_alloc_order(PAGE_HUGE_ORDER, ALLOC_ZERO | ALLOC_HIGH);
+	if (p == NULL)
+		return -E_NO_MEM;
+
 	// Map newly-allocated page to target page dir
 	if (err = page_insert(e->env_pgdir, p, va, perm)) {
-		page_free(p);
+		page_free_order(p, p->pp_order);
 		return err;
 	}
 
@@ -206,11 +303,17 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
-//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_INVAL if srcva is (or is inside) a huge page but perm doesn't have
+//		PTE_PS, or the other way around: huge pages are only ever
+//		mapped whole, at PTSIZE-aligned srcva and dstva.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables,
+//		or to record the new mapping in the page's rmap.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     			 envid_t dstenvid, void *dstva, int perm, bool check)
 {
+	uint64_t start = read_tsc();
+
 	// Check source and dest addresses
 	if ((uint32_t)srcva >= UTOP || (uint32_t)srcva % PGSIZE != 0)
 		return -E_INVAL;
@@ -218,7 +321,10 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 
 	// Check permissions
-	if (perm & ~PTE_SYSCALL || !(perm & PTE_U) || !(perm & PTE_P))
+	if (perm & ~(PTE_SYSCALL|PTE_PS) || !(perm & PTE_U) || !(perm & PTE_P))
+		return -E_INVAL;
+	if (perm & PTE_PS &&
+	    ((uint32_t)srcva % PTSIZE != 0 || (uint32_t)dstva % PTSIZE != 0))
 		return -E_INVAL;
 
 	// Get source and dest Env structs,
@@ -231,11 +337,30 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if (err = envid2env(dstenvid, &dest_e, check))
 		return err;
 
+	// The source may be part of the binary that isn't loaded yet
+	env_vm_populate(src_e, (uintptr_t) srcva, (uintptr_t) srcva + PGSIZE);
+
+	// A writable mapping of demand-zero memory needs a real page
+	// behind it first, or the two would go their separate ways on
+	// the first write. So does one out of a page table shared since
+	// a fork, whose entries may say PTE_W but are copy-on-write.
+	if (perm & PTE_W &&
+	    ((err = page_table_unshare(src_e->env_pgdir, (uintptr_t) srcva)) ||
+	     (err = page_zero_break(src_e->env_pgdir, srcva))))
+		return err;
+
 	// Look up source page
 	struct PageInfo *p;
 	pte_t  *pte_p;
 	p = page_lookup(src_e->env_pgdir, srcva, &pte_p);
 	// cprintf("[sys_page_map] srcva: %x, dstva: %x, pte: %x\n", srcva, dstva, *pte_p);
+	if (!p)
+		return -E_INVAL;
+
+	// The references for a huge page are all counted on its first
+	// page, so a huge page can't be mapped piecemeal.
+	if ((perm & PTE_PS) != (*pte_p & PTE_PS))
+		return -E_INVAL;
 
 	// If caller wants to make it writable,
 	// ensure it's writable in the source mapping
@@ -254,6 +379,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if (err = page_insert(dest_e->env_pgdir, p, dstva, perm))
 		return err;
 
+	call_stats_add(&page_map_stats, start);
 	return 0;
 }
 
@@ -264,6 +390,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if va is in a page table shared since a fork, and there's
+//		no memory to give envid a copy of its own.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -278,11 +406,54 @@ sys_page_unmap(envid_t envid, void *va)
 	if (err = envid2env(envid, &e, 1))
 		return err;
 
+	if (err = page_table_unshare(e->env_pgdir, (uintptr_t) va))
+		return err;
 	page_remove(e->env_pgdir, va);
 
 	return 0;
 }
 
+// Reserve [va, va+len) in the current environment's address space for
+// memory that's allocated as it's used: the first access to a page in
+// it maps a zeroed page there with permission 'perm', in the kernel,
+// with no system call or page fault upcall for each page. Perm has the
+// same restrictions as in sys_page_alloc, except that huge pages aren't
+// allowed. Pages already mapped in the range stay as they are, and a
+// page unmapped in it is zeroed again when next used.
+//
+// 'flags' is a combination of
+//	VM_GROWSDOWN, for a stack: a fault below the region, up to
+//		ENV_STACK_MAX below its end and leaving a page free above
+//		anything else below, grows the region down to it.
+//	VM_AROUND(n), to map the rest of the aligned block of n pages
+//		around each page faulted on at the same time (at most
+//		NPTENTRIES).
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va or len is not page-aligned, len is 0, or the range
+//		isn't all below UTOP.
+//	-E_INVAL if perm or flags is inappropriate.
+//	-E_INVAL if the range overlaps the binary or another region.
+//	-E_NO_MEM if the environment has ENV_NREGIONS regions already, or
+//		there's no memory to record another.
+static int
+sys_vm_reserve(void *va, size_t len, int perm, int flags)
+{
+	// Check address
+	if ((uint32_t)va >= UTOP || (uint32_t)va % PGSIZE != 0 ||
+	    len == 0 || len % PGSIZE != 0 || len > UTOP - (uint32_t)va)
+		return -E_INVAL;
+
+	// Check permissions and flags
+	if (perm & ~PTE_SYSCALL || !(perm & PTE_U) || !(perm & PTE_P))
+		return -E_INVAL;
+	if (flags & ~VM_GROWSDOWN & (VM_AROUND(1) - 1) ||
+	    VM_AROUND_PAGES(flags) > NPTENTRIES)
+		return -E_INVAL;
+
+	return env_vm_reserve(curenv, (uintptr_t) va, len, perm, flags);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -415,7 +586,9 @@ static const char *syscallname(int syscallno)
 		"env_set_pgfault_upcall",
 		"yield",
 		"ipc_try_send",
-		"ipc_recv"
+		"ipc_recv",
+		"fork",
+		"vm_reserve"
 	};
 
 	if (syscallno < sizeof(names)/sizeof(names[0]))
@@ -423,6 +596,27 @@ static const char *syscallname(int syscallno)
 	return "(unknown syscall)";
 }
 
+static void
+print_call_stats(const char *name, struct CallStats *fs)
+{
+	cprintf("%s: %u", name, fs->fs_count);
+	if (fs->fs_count)
+		cprintf(", %llu cycles average, %llu max",
+			fs->fs_cycles / fs->fs_count, fs->fs_max_cycles);
+	cprintf("\n");
+}
+
+//
+// Print system call statistics.
+//
+void
+print_syscall_stats(void)
+{
+	print_call_stats("exoforks", &exofork_stats);
+	print_call_stats("forks", &fork_stats);
+	print_call_stats("page maps", &page_map_stats);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -438,6 +632,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_exofork:
 			return sys_exofork();
 
+		case SYS_fork:
+			return sys_fork();
+
 		case SYS_env_set_status:
 			return sys_env_set_status(a1, a2);
 
@@ -453,6 +650,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_page_unmap:
 			return sys_page_unmap(a1, (void *)a2);
 
+		case SYS_vm_reserve:
+			return sys_vm_reserve((void *)a1, a2, a3, a4);
+
 		case SYS_ipc_recv:
 			return sys_ipc_recv((void *)a1);
 
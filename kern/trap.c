@@ -106,6 +106,9 @@ trap_init(void)
 	// allowing user code to trigger it.
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, th48, 3);
 
+	// Sent by other CPUs only, see tlb_invalidate
+	SETGATE(idt[T_TLBSHOOT], 0, GD_KT, th49, 0);
+
 	// Per-CPU setup
 	trap_init_percpu();
 }
@@ -247,6 +250,21 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Do TLB shootdowns right away, without the big kernel lock: the
+	// CPU that sent this one is probably holding it, waiting for us.
+	// Then go straight back to whatever we interrupted, user code or
+	// the hlt in sched_halt. In sched_halt there's no curenv, so this
+	// can't use env_pop_tf.
+	if (tf->tf_trapno == T_TLBSHOOT) {
+		tlb_shootdown_drain();
+		lapic_eoi();
+		trapframe_pop(tf);
+	}
+
+	// Same goes for shootdowns that got queued for us while we were
+	// running user code: do them before we wait on the kernel lock.
+	tlb_leave_user();
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -302,21 +320,60 @@ trap(struct Trapframe *tf)
 }
 
 
+// The kernel's exception table: for each instruction allowed to page
+// fault in the kernel (see kern/usercopy.S), where to resume if it does.
+struct ExTableEntry {
+	uintptr_t ex_insn;
+	uintptr_t ex_fixup;
+};
+
+// Return where to resume after a fault at kernel instruction 'eip', or
+// 0 if it's not supposed to fault.
+static uintptr_t
+extable_fixup(uintptr_t eip)
+{
+	extern const struct ExTableEntry __start_ex_table[], __stop_ex_table[];
+	const struct ExTableEntry *ex;
+
+	for (ex = __start_ex_table; ex < __stop_ex_table; ex++)
+		if (ex->ex_insn == eip)
+			return ex->ex_fixup;
+	return 0;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	uintptr_t fixup;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
 
-	// Handle kernel-mode page faults.
-	if ((tf->tf_cs & 3) == 0)
-		panic("Kernel mode PGFault! Dying!");
+	// Handle kernel-mode page faults. The only ones we expect are
+	// copyin & co. running into user memory. If it's demand-zero
+	// memory, give it a page and retry; otherwise it's bad memory, so
+	// go back to the kernel code that faulted, at its fixup, to return
+	// an error.
+	if ((tf->tf_cs & 3) == 0) {
+		if ((fixup = extable_fixup(tf->tf_eip))) {
+			if (!curenv ||
+			    page_fault_resolve(curenv, fault_va, tf->tf_err) < 0)
+				tf->tf_eip = fixup;
+			trapframe_pop(tf);
+		}
+		panic("Kernel mode PGFault at va %08x, ip %08x! Dying!",
+		      fault_va, tf->tf_eip);
+	}
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Writes to demand-zero and copy-on-write memory are the kernel's
+	// to take care of, and go straight back to the faulting instruction
+	if (page_fault_resolve(curenv, fault_va, tf->tf_err) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -360,21 +417,18 @@ page_fault_handler(struct Trapframe *tf)
 	if (ux_esp < UXSTACKTOP - PGSIZE)
 		panic("not enough space for UTrapframe");
 
-	// Make sure user can write to its exception stack and that
-	// it hasn't already overflowed. Said exception stack is one
-	// page, and there's an unmapped page below it, so this test
-	// ought to cover both cases by testing whatever page contains
-	// the address at tf_esp.
-	user_mem_assert(curenv, (void *)ux_esp, 1, PTE_W);  // If fail, does not return
-
-	// Build the frame
-	struct UTrapframe *utf = (struct UTrapframe *)(ux_esp);
-	utf->utf_fault_va = fault_va;
-	utf->utf_err = tf->tf_err;
-	utf->utf_regs = tf->tf_regs;
-	utf->utf_eip = tf->tf_eip;
-	utf->utf_eflags = tf->tf_eflags;
-	utf->utf_esp = tf->tf_esp;
+	// Build the frame, then copy it out to the exception stack. If
+	// the user can't write to its exception stack, or it has already
+	// overflowed (there's an unmapped page below it), the copy fails.
+	struct UTrapframe utf;
+	utf.utf_fault_va = fault_va;
+	utf.utf_err = tf->tf_err;
+	utf.utf_regs = tf->tf_regs;
+	utf.utf_eip = tf->tf_eip;
+	utf.utf_eflags = tf->tf_eflags;
+	utf.utf_esp = tf->tf_esp;
+	if (copyout((void *) ux_esp, &utf, sizeof(utf)) < 0)
+		user_mem_fault(curenv);  // Does not return
 
 	// Modify curenv to execute at its page fault handler
 	// using the exception stack, and run it.
@@ -3,9 +3,31 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+//
+// Copy-on-write fault in a 4MB huge page: same as for a normal page,
+// except the copy is a whole new huge page, built at UTEMP (the only
+// PTSIZE-aligned scratch space we have).
+//
+static void
+pgfault_huge(void *flt_addr)
+{
+	int r;
+	void *va = ROUNDDOWN(flt_addr, PTSIZE);
+
+	if (!(uvpd[PDX(flt_addr)] & PTE_COW))
+		panic("[fork] pgfault received a write fault for non-COW huge page\n");
+
+	if (r = sys_page_alloc(0, UTEMP, PTE_U|PTE_P|PTE_W|PTE_PS))
+		panic("[fork] pgfault:sys_page_alloc failed %x for addr: %x", r, flt_addr);
+
+	memcpy(UTEMP, va, PTSIZE);
+
+	if (r = sys_page_map(0, UTEMP, 0, va, PTE_U|PTE_P|PTE_W|PTE_PS))
+		panic("[fork] pgfault:sys_page_map failed %x for addr: %x", r, flt_addr);
+
+	if (r = sys_page_unmap(0, UTEMP))
+		panic("[fork] pgfault:sys_page_unmap failed %x for addr: %x", r, UTEMP);
+}
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -20,6 +42,13 @@ pgfault(struct UTrapframe *utf)
 		panic("[fork] pgfault received fault that wasn't a write\n");
 
 	void *flt_addr = (void *) utf->utf_fault_va;
+
+	// Huge pages have no uvpt entries; their PDE is the whole story
+	if (uvpd[PDX(flt_addr)] & PTE_PS) {
+		pgfault_huge(flt_addr);
+		return;
+	}
+
 	if (!(uvpt[PGNUM(flt_addr)] & PTE_COW))
 		panic("[fork] pgfault received a write fault for non-COW page\n");
 
@@ -76,7 +105,62 @@ duppage(envid_t envid, uintptr_t va)
 }
 
 //
-// User-level fork with copy-on-write.
+// Like duppage, but for the 4MB huge page at va: the whole huge page
+// is shared copy-on-write in one go.
+//
+static int
+duphugepage(envid_t envid, uintptr_t va)
+{
+	int r;
+	uint32_t perm = uvpd[PDX(va)] & PTE_SYSCALL;
+	if (perm & PTE_W || perm & PTE_COW) {
+		if (r = sys_page_map(0, (void *)va, envid, (void *)va, PTE_U|PTE_P|PTE_COW|PTE_PS))
+			panic("duphugepage: sys_page_map failed for %x: %d\n", va, r);
+		if (r = sys_page_map(0, (void *)va, 0, (void *)va, PTE_U|PTE_P|PTE_COW|PTE_PS))
+			panic("duphugepage: sys_page_map failed for %x: %d\n", va, r);
+	} else {
+		if (r = sys_page_map(0, (void *)va, envid, (void *)va, PTE_U|PTE_P|PTE_PS))
+			panic("duphugepage: sys_page_map failed for %x: %d\n", va, r);
+	}
+	return 0;
+}
+
+//
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then have the kernel
+// create a child with a copy-on-write copy of our address space, its
+// own exception stack and our page fault handler setup, all in one
+// system call (see sys_fork).
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+// It is also OK to panic on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	set_pgfault_handler(pgfault);
+
+	if ((envid = sys_fork()) < 0)
+		panic("sys_fork: %e\n", envid);
+
+	if (envid == 0) {
+		// We're the child.
+		// The copied value of the global variable 'thisenv'
+		// is no longer valid (it refers to the parent!).
+		// Fix it and return 0.
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	return envid;
+}
+
+//
+// User-level fork with copy-on-write, the way fork worked before the
+// kernel could do it all in sys_fork. Kept to compare against it
+// (see user/forkbench).
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -90,7 +174,7 @@ duppage(envid_t envid, uintptr_t va)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	set_pgfault_handler(pgfault);
 
@@ -116,9 +200,19 @@ fork(void)
 	// Copy address space
 	uintptr_t va;
 	for (va = 0; va < USTACKTOP; va += PGSIZE) {
-		// TODO: Could optimize so if the PDE is not present,
-		// skip the whole thing instead of still looping through
-		// all its PTEs.
+		// If there's no page table, there's nothing in its 4MB
+		// to copy: skip straight to the next one.
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
+		// A huge page's PDE has no page table under it, so there's
+		// nothing to find in uvpt: share the whole 4MB at once.
+		if ((uvpd[PDX(va)] & (PTE_P|PTE_U|PTE_PS)) == (PTE_P|PTE_U|PTE_PS)) {
+			duphugepage(envid, va);
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
 		if (uvpd[PDX(va)] & PTE_P &&  // see memlayout.h for uvpd/uvpt explanation
 				uvpd[PDX(va)] & PTE_U &&
 		  	uvpt[PGNUM(va)] & PTE_P &&
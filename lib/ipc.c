@@ -64,12 +64,18 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
+// envs[] is only mapped as far as the kernel has grown it, so stop at
+// the first page that isn't there.
 envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
+	for (i = 0; i < NENV; i++) {
+		if (!(uvpd[PDX(&envs[i])] & PTE_P) ||
+		    !(uvpt[PGNUM(&envs[i])] & PTE_P))
+			break;
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
+	}
 	return 0;
 }
@@ -85,8 +85,22 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_vm_reserve(void *va, size_t len, int perm, int flags)
+{
+	return syscall(SYS_vm_reserve, 1, (uint32_t) va, len, perm, flags, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+// sys_fork needn't be: the child's copy of our stack is made in the
+// kernel, after the int, so it sees the same stack we return to.
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
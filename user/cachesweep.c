@@ -0,0 +1,65 @@
+// sweep buffers around the size of the L2 cache, to show the effect of
+// page colouring (boot with 'make PAGECOLOR=1', or use the 'pagecolor'
+// monitor command, and compare)
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define BUF_ADDR	((char *) 0x10000000)
+#define LINE		64
+#define NPASSES		8
+
+// Size of the L2 cache in bytes, or a guess if CPUID won't say
+static size_t
+l2_size(void)
+{
+	uint32_t eax, ecx;
+
+	cpuid(0x80000000, &eax, NULL, NULL, NULL);
+	if (eax < 0x80000006)
+		return 512 * 1024;
+	cpuid(0x80000006, NULL, NULL, &ecx, NULL);
+	return (ecx >> 16) * 1024;
+}
+
+// Read one word per cache line of [BUF_ADDR, BUF_ADDR + size), NPASSES
+// times after a warm-up pass, and return the cycles per line.
+static uint32_t
+sweep(size_t size)
+{
+	volatile int *p;
+	uint32_t start, cycles;
+	int pass, sum = 0;
+
+	for (pass = -1; pass < NPASSES; pass++) {
+		if (pass == 0)
+			start = (uint32_t) read_tsc();
+		for (p = (int *) BUF_ADDR; p < (int *) (BUF_ADDR + size);
+		     p += LINE / sizeof(int))
+			sum += *p;
+	}
+	cycles = (uint32_t) read_tsc() - start;
+	return cycles / (NPASSES * (size / LINE));
+}
+
+void
+umain(int argc, char **argv)
+{
+	size_t l2 = l2_size(), size, off;
+	int r;
+
+	cprintf("L2 cache: %uKB\n", l2 / 1024);
+
+	// Fault the whole buffer in, in order, so each page gets the colour
+	// that goes with its address (if colouring is on)
+	for (off = 0; off < 2 * l2; off += PGSIZE) {
+		if ((r = sys_page_alloc(0, BUF_ADDR + off, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		BUF_ADDR[off] = 1;
+	}
+
+	for (size = l2 / 4; size <= 2 * l2; size *= 2)
+		cprintf("%6uKB buffer: %u cycles per line\n",
+			size / 1024, sweep(size));
+	cprintf("cachesweep done\n");
+}
@@ -0,0 +1,71 @@
+// time fork, done in the kernel by sys_fork, against ufork, the old way of
+// doing it from user space a page at a time, and check both give the
+// child a copy-on-write copy of our memory
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define BUF_ADDR	((char *) 0x10000000)
+#define NPAGES		64
+#define NFORKS		8
+
+// Wait for our child 'id' to exit
+static void
+wait_child(envid_t id)
+{
+	const volatile struct Env *e = &envs[ENVX(id)];
+
+	while (e->env_id == id && e->env_status != ENV_FREE &&
+	       e->env_status != ENV_REAPING)
+		sys_yield();
+}
+
+// Fork NFORKS children with 'f' and return the average cycles per call
+// in the parent. Each child checks it sees our memory, writes all over
+// it, and exits.
+static uint32_t
+bench(const char *name, envid_t (*f)(void))
+{
+	uint32_t start, cycles = 0;
+	envid_t id;
+	int i, j;
+
+	for (i = 0; i < NFORKS; i++) {
+		start = (uint32_t) read_tsc();
+		if ((id = f()) < 0)
+			panic("%s: %e", name, id);
+		if (id == 0) {
+			for (j = 0; j < NPAGES; j++) {
+				if (BUF_ADDR[j * PGSIZE] != (char) j)
+					panic("%s: child sees %d at page %d",
+					      name, BUF_ADDR[j * PGSIZE], j);
+				BUF_ADDR[j * PGSIZE] = -1;
+			}
+			exit();
+		}
+		cycles += (uint32_t) read_tsc() - start;
+		wait_child(id);
+	}
+
+	for (j = 0; j < NPAGES; j++)
+		if (BUF_ADDR[j * PGSIZE] != (char) j)
+			panic("%s: child's write showed up in the parent", name);
+	return cycles / NFORKS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	// Some private, writable pages for the forks to copy
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, BUF_ADDR + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		BUF_ADDR[i * PGSIZE] = i;
+	}
+
+	cprintf("fork: %u cycles\n", bench("fork", fork));
+	cprintf("ufork: %u cycles\n", bench("ufork", ufork));
+	cprintf("forkbench done\n");
+}
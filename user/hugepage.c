@@ -0,0 +1,40 @@
+// test 4MB huge pages, and sharing them copy-on-write across fork
+
+#include <inc/lib.h>
+
+#define HUGE_ADDR	((char*)0x10000000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int r;
+
+	if ((r = sys_page_alloc(0, HUGE_ADDR, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	assert(uvpd[PDX(HUGE_ADDR)] & PTE_PS);
+
+	// a huge page is mapped whole or not at all
+	if ((r = sys_page_map(0, HUGE_ADDR + PGSIZE, 0, UTEMP, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map of part of a huge page: %e", r);
+
+	strcpy(HUGE_ADDR, "parent start");
+	strcpy(HUGE_ADDR + PTSIZE - PGSIZE, "parent end");
+
+	if ((who = fork()) == 0) {
+		assert(strcmp(HUGE_ADDR, "parent start") == 0);
+		assert(!(uvpd[PDX(HUGE_ADDR)] & PTE_W));
+		strcpy(HUGE_ADDR + PTSIZE - PGSIZE, "child end");
+		assert(uvpd[PDX(HUGE_ADDR)] & PTE_W);
+		assert(strcmp(HUGE_ADDR, "parent start") == 0);
+		cprintf("child wrote its copy of the huge page\n");
+		return;
+	}
+
+	while (envs[ENVX(who)].env_status != ENV_FREE)
+		sys_yield();
+
+	assert(strcmp(HUGE_ADDR + PTSIZE - PGSIZE, "parent end") == 0);
+	strcpy(HUGE_ADDR, "parent again");
+	cprintf("huge page test passed\n");
+}
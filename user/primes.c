@@ -4,9 +4,10 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENV is 1024, we can print 1022 primes before running out.
-// The remaining two environments are the integer generator at the bottom
-// of main and user/idle.
+// The kernel grows its environment table as needed, up to NENV (32768)
+// environments, so with enough memory we can print NENV - 2 primes
+// before running out. The remaining two environments are the integer
+// generator at the bottom of main and user/idle.
 
 #include <inc/lib.h>
 
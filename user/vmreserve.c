@@ -0,0 +1,86 @@
+// test memory reserved with sys_vm_reserve: zeroed pages as it's touched,
+// fault-around, a stack that grows down, and regions inherited by fork
+
+#include <inc/lib.h>
+
+#define HEAP_ADDR	((char *) 0x10000000)
+#define HEAP_PAGES	64
+#define AROUND		16
+
+// Use 'depth' pages of stack, a page at a time, and return their sum
+static int
+recurse(int depth)
+{
+	volatile char buf[PGSIZE - 64];
+
+	buf[0] = depth;
+	if (depth == 0)
+		return 0;
+	return buf[0] + recurse(depth - 1);
+}
+
+// How many of the heap's pages are mapped
+static int
+heap_mapped(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < HEAP_PAGES; i++)
+		if ((uvpd[PDX(HEAP_ADDR)] & PTE_P) &&
+		    (uvpt[PGNUM(HEAP_ADDR + i * PGSIZE)] & PTE_P))
+			n++;
+	return n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t id;
+	int i, r;
+
+	if ((r = sys_vm_reserve(HEAP_ADDR, HEAP_PAGES * PGSIZE,
+				PTE_P|PTE_U|PTE_W, VM_AROUND(AROUND))) < 0)
+		panic("sys_vm_reserve: %e", r);
+
+	// bad arguments, and overlapping regions, are refused
+	if ((r = sys_vm_reserve(HEAP_ADDR + 1, PGSIZE, PTE_P|PTE_U, 0)) != -E_INVAL)
+		panic("sys_vm_reserve of unaligned va: %e", r);
+	if ((r = sys_vm_reserve(HEAP_ADDR + PGSIZE, PGSIZE, PTE_P|PTE_U, 0)) != -E_INVAL)
+		panic("sys_vm_reserve over the heap: %e", r);
+	if ((r = sys_vm_reserve(HEAP_ADDR - PTSIZE, PGSIZE, PTE_P|PTE_U|PTE_PS, 0)) != -E_INVAL)
+		panic("sys_vm_reserve of a huge page: %e", r);
+
+	// nothing's there until it's touched, and then it's zero, and
+	// comes a block at a time
+	assert(heap_mapped() == 0);
+	assert(HEAP_ADDR[5 * PGSIZE] == 0);
+	assert(heap_mapped() == AROUND);
+	for (i = 0; i < HEAP_PAGES; i++)
+		HEAP_ADDR[i * PGSIZE + 1] = i;
+	assert(heap_mapped() == HEAP_PAGES);
+	cprintf("heap ok\n");
+
+	// the stack grows to fit
+	assert(recurse(8) == 36);
+	cprintf("stack ok\n");
+
+	// a child gets the regions too, and its own pages in them
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		for (i = 0; i < HEAP_PAGES; i++) {
+			assert(HEAP_ADDR[i * PGSIZE + 1] == (char) i);
+			HEAP_ADDR[i * PGSIZE + 1] = -1;
+		}
+		assert(recurse(16) == 136);
+		cprintf("child ok\n");
+		return;
+	}
+	while (envs[ENVX(id)].env_id == id &&
+	       envs[ENVX(id)].env_status != ENV_FREE &&
+	       envs[ENVX(id)].env_status != ENV_REAPING)
+		sys_yield();
+	for (i = 0; i < HEAP_PAGES; i++)
+		assert(HEAP_ADDR[i * PGSIZE + 1] == (char) i);
+	cprintf("vmreserve done\n");
+}